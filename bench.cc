@@ -0,0 +1,97 @@
+#include <iostream>
+#include <chrono>
+#include <cmath>
+#include <random>
+#include <string>
+#include <vector>
+#include "utils.h"
+using namespace std;
+
+// Microbenchmarks for the numeric kernels in utils.cc. Run after changing
+// them, or to compare a portable build against ARCH=-march=native.
+
+// Keeps the compiler from dropping a result it can see is unused
+static volatile double sink;
+
+// Average nanoseconds per call of f, over enough calls to take ~0.2s
+template <typename F>
+static double time_per_call(F f) {
+  typedef chrono::steady_clock clock;
+  unsigned calls = 1;
+  while (true) {
+    clock::time_point start = clock::now();
+    for (unsigned i = 0; i < calls; ++i) {
+      f();
+    }
+    double ns = chrono::duration<double, nano>(clock::now() - start).count();
+    if (ns > 2.0e8 || calls >= (1U << 30)) {
+      return ns / calls;
+    }
+    calls *= 2;
+  }
+}
+
+static double naive_log_sum_exp(const vector<double>& v) {
+  double m = v[0];
+  for (double x : v) {
+    m = max(m, x);
+  }
+  double sum = 0.0;
+  for (double x : v) {
+    sum += exp(x - m);
+  }
+  return m + log(sum);
+}
+
+static void bench_exp(const vector<double>& x) {
+  vector<double> y(x.size());
+  double worst = 0.0;
+  fast_exp(x.data(), y.data(), x.size());
+  for (unsigned i = 0; i < x.size(); ++i) {
+    worst = max(worst, fabs(y[i] - exp(x[i])) / exp(x[i]));
+  }
+
+  double std_ns = time_per_call([&]() {
+    for (unsigned i = 0; i < x.size(); ++i) {
+      y[i] = exp(x[i]);
+    }
+    sink = y[0];
+  });
+  double fast_ns = time_per_call([&]() {
+    fast_exp(x.data(), y.data(), x.size());
+    sink = y[0];
+  });
+  cerr << "exp n=" << x.size() << ": std " << std_ns << "ns, fast_exp " << fast_ns
+       << "ns, max relative error " << worst << endl;
+}
+
+static void bench_log_sum_exp(const vector<double>& v) {
+  double naive_ns = time_per_call([&]() { sink = naive_log_sum_exp(v); });
+  double two_pass_ns = time_per_call([&]() { sink = log_sum_exp(v.data(), v.size()); });
+  double online_ns = time_per_call([&]() { sink = log_sum_exp_online(v.data(), v.size()); });
+  cerr << "log_sum_exp n=" << v.size() << ": naive " << naive_ns << "ns, two-pass "
+       << two_pass_ns << "ns, online " << online_ns << "ns" << endl;
+}
+
+int main(int argc, char** argv) {
+  mt19937 rng(1);
+  uniform_real_distribution<double> log_probs(-50.0, 0.0);
+  uniform_real_distribution<double> exponents(-700.0, 700.0);
+
+  for (unsigned n : {8, 32, 128, 1024}) {
+    vector<double> x(n);
+    for (double& xi : x) {
+      xi = exponents(rng);
+    }
+    bench_exp(x);
+  }
+
+  for (unsigned n : {8, 32, 128, 1024}) {
+    vector<double> v(n);
+    for (double& vi : v) {
+      vi = log_probs(rng);
+    }
+    bench_log_sum_exp(v);
+  }
+  return 0;
+}
@@ -0,0 +1,151 @@
+#include <cassert>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include "checkpoint.h"
+using namespace std;
+
+static const char checkpoint_magic[8] = {'C', 'R', 'F', 'C', 'K', 'P', 'T', '2'};
+
+static void write_string(ostream& out, const string& s) {
+  const uint64_t size = s.size();
+  out.write(reinterpret_cast<const char*>(&size), sizeof(size));
+  out.write(s.data(), s.size());
+}
+
+static bool read_string(istream& in, string& s) {
+  uint64_t size;
+  if (!in.read(reinterpret_cast<char*>(&size), sizeof(size))) {
+    return false;
+  }
+  s.resize(size);
+  return size == 0 || in.read(&s[0], size);
+}
+
+template<typename T>
+static void write_value(ostream& out, const T& value) {
+  out.write(reinterpret_cast<const char*>(&value), sizeof(value));
+}
+
+template<typename T>
+static bool read_value(istream& in, T& value) {
+  return (bool)in.read(reinterpret_cast<char*>(&value), sizeof(value));
+}
+
+static void write_map(ostream& out, const map<string, double>& m) {
+  write_value<uint64_t>(out, m.size());
+  for (auto& kvp : m) {
+    write_string(out, kvp.first);
+    write_value(out, kvp.second);
+  }
+}
+
+static bool read_map(istream& in, map<string, double>& m) {
+  uint64_t size;
+  if (!read_value(in, size)) {
+    return false;
+  }
+  m.clear();
+  for (uint64_t i = 0; i < size; ++i) {
+    string key;
+    double value;
+    if (!read_string(in, key) || !read_value(in, value)) {
+      return false;
+    }
+    m.emplace_hint(m.end(), key, value);
+  }
+  return true;
+}
+
+bool read_checkpoint(const string& filename, training_state& state) {
+  ifstream in(filename, ios::binary);
+  char magic[sizeof(checkpoint_magic)];
+  if (!in.read(magic, sizeof(magic)) || memcmp(magic, checkpoint_magic, sizeof(magic)) != 0) {
+    return false;
+  }
+  if (!read_value(in, state.key) || !read_map(in, state.weights) || !read_map(in, state.historical_deltas) ||
+      !read_map(in, state.historical_gradients)) {
+    return false;
+  }
+  uint64_t num_suffixes;
+  if (!read_value(in, num_suffixes)) {
+    return false;
+  }
+  state.suffixes.resize(num_suffixes);
+  for (string& suffix : state.suffixes) {
+    if (!read_string(in, suffix)) {
+      return false;
+    }
+  }
+  return read_value(in, state.epoch) && read_value(in, state.example) &&
+    read_value(in, state.num_examples) && read_value(in, state.epoch_loss) &&
+    read_string(in, state.rng);
+}
+
+void write_checkpoint(const string& filename, const training_state& state) {
+  const string temp_filename = filename + ".tmp";
+  {
+    ofstream out(temp_filename, ios::binary);
+    out.write(checkpoint_magic, sizeof(checkpoint_magic));
+    write_value(out, state.key);
+    write_map(out, state.weights);
+    write_map(out, state.historical_deltas);
+    write_map(out, state.historical_gradients);
+    write_value<uint64_t>(out, state.suffixes.size());
+    for (const string& suffix : state.suffixes) {
+      write_string(out, suffix);
+    }
+    write_value(out, state.epoch);
+    write_value(out, state.example);
+    write_value(out, state.num_examples);
+    write_value(out, state.epoch_loss);
+    write_string(out, state.rng);
+    out.close();
+    if (!out) {
+      cerr << "Unable to write checkpoint " << temp_filename << "." << endl;
+      remove(temp_filename.c_str());
+      return;
+    }
+  }
+  if (rename(temp_filename.c_str(), filename.c_str()) != 0) {
+    cerr << "Unable to write checkpoint " << filename << "." << endl;
+    remove(temp_filename.c_str());
+  }
+}
+
+checkpointer::checkpointer(const string& filename) :
+    filename(filename), stopping(false), writer(&checkpointer::work, this) {}
+
+checkpointer::~checkpointer() {
+  {
+    lock_guard<mutex> lock(m);
+    stopping = true;
+  }
+  wake.notify_one();
+  writer.join();
+}
+
+void checkpointer::save(unique_ptr<training_state> state) {
+  {
+    lock_guard<mutex> lock(m);
+    pending = move(state);
+  }
+  wake.notify_one();
+}
+
+void checkpointer::work() {
+  while (true) {
+    unique_ptr<training_state> state;
+    {
+      unique_lock<mutex> lock(m);
+      wake.wait(lock, [this] { return pending || stopping; });
+      if (!pending) {
+        return;
+      }
+      state = move(pending);
+    }
+    write_checkpoint(filename, *state);
+  }
+}
@@ -0,0 +1,63 @@
+#pragma once
+#include <condition_variable>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+using std::condition_variable;
+using std::map;
+using std::mutex;
+using std::string;
+using std::thread;
+using std::unique_ptr;
+using std::vector;
+
+// Everything needed to resume training exactly where it stopped: the
+// model and optimizer state, how far through which epoch training got,
+// the loss of that epoch so far, and the state the trainer's random number
+// generator had at the start of the epoch, from which the epoch's example
+// order is redrawn. key identifies the run (its data and settings), so a
+// checkpoint is never resumed by a different one.
+struct training_state {
+  uint64_t key = 0;
+  map<string, double> weights;
+  map<string, double> historical_deltas;
+  map<string, double> historical_gradients;
+  vector<string> suffixes;
+  unsigned epoch = 0;
+  unsigned example = 0;
+  unsigned num_examples = 0;
+  double epoch_loss = 0.0;
+  string rng;
+};
+
+// Returns false if filename is missing or is not a checkpoint
+bool read_checkpoint(const string& filename, training_state& state);
+// Writes to a temporary file and renames it over filename, so a job that
+// is killed mid-write leaves the previous checkpoint intact.
+void write_checkpoint(const string& filename, const training_state& state);
+
+// Writes checkpoints on a background thread. If a new state is saved
+// while an older one is still waiting, only the newer one is written.
+// The destructor writes whatever is pending before returning.
+class checkpointer {
+public:
+  explicit checkpointer(const string& filename);
+  ~checkpointer();
+  void save(unique_ptr<training_state> state);
+
+private:
+  checkpointer(const checkpointer&);
+  checkpointer& operator=(const checkpointer&);
+  void work();
+
+  string filename;
+  mutex m;
+  condition_variable wake;
+  unique_ptr<training_state> pending;
+  bool stopping;
+  thread writer;
+};
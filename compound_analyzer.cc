@@ -4,47 +4,157 @@
 #include "compound_analyzer.h"
 using namespace std;
 
-compound_analyzer::compound_analyzer(ttable* fwd_ttable) {
+static vector<string> non_empty(vector<string> strings) {
+  strings.erase(remove(strings.begin(), strings.end(), ""), strings.end());
+  return strings;
+}
+
+const uint32_t compound_analyzer::version;
+const unsigned compound_analyzer::min_length;
+const unsigned compound_analyzer::reachable_min_length;
+const unsigned compound_analyzer::max_words;
+
+uint64_t compound_analyzer::fingerprint() {
+  const uint64_t fields[] = {version, min_length, reachable_min_length};
+  uint64_t h = 0xcbf29ce484222325ULL;
+  for (uint64_t field : fields) {
+    h = (h ^ field) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
+// The matcher is built once over every target in the ttable,
+// so the ttable must be loaded before the analyzer is constructed.
+compound_analyzer::compound_analyzer(ttable* fwd_ttable)
+  : matcher(non_empty(fwd_ttable->getTargets())) {
   this->fwd_ttable = fwd_ttable;
 }
 
-// Takes in a set of translations and an ordering
-// and finds the suffixes necessary to create the compound word given
-// out of the pieces given, in the order given.
-// If this is not possible, returns false. If possible, returns true.
-bool compound_analyzer::decompose(string compound, const vector<string>& pieces,
-    vector<unsigned> permutation, vector<string>& suffixes) {
-  suffixes.clear();
-  suffixes.resize(pieces.size());
-  for (unsigned i = 0; i < suffixes.size(); ++i) {
-    suffixes[i] = "";
+// Finds every ttable target that occurs in german, along with the
+// sorted offsets where it starts, in one scan of the string.
+map<string, vector<unsigned> > compound_analyzer::find_pieces(const string& german) {
+  vector<tuple<unsigned, unsigned> > matches;
+  matcher.match(german, matches);
+  map<string, vector<unsigned> > occurrences;
+  for (auto& m : matches) {
+    occurrences[matcher.pattern(get<0>(m))].push_back(get<1>(m));
   }
+  return occurrences;
+}
 
-  string remainder = compound;
-  for (unsigned i = 0; i < permutation.size(); ++i) {
-    int j = permutation[i];
-    size_t location = remainder.find(pieces[j]);
-    if (location == string::npos) {
-      return false;
+// For each english word, lists the empty translation followed by the
+// translations at least min_length long that occur in the compound, in the
+// same order getTranslations returns them, along with where each occurs.
+void compound_analyzer::find_candidates(const vector<string>& english,
+    const map<string, vector<unsigned> >& occurrences, unsigned min_length,
+    vector<vector<string> >& candidates, vector<vector<const vector<unsigned>*> >& positions) {
+  candidates.clear();
+  positions.clear();
+  for (const string& w : english) {
+    vector<string> matching_translations;
+    vector<const vector<unsigned>*> matching_positions;
+    matching_translations.push_back("");
+    matching_positions.push_back(NULL);
+    for (auto& kvp : occurrences) {
+      double score;
+      if (kvp.first.size() >= min_length && fwd_ttable->getScore(w, kvp.first, score)) {
+        matching_translations.push_back(kvp.first);
+        matching_positions.push_back(&kvp.second);
+      }
     }
+    candidates.push_back(matching_translations);
+    positions.push_back(matching_positions);
+  }
+}
 
-    string prefix = remainder.substr(0, location);
-    if (i == 0 || pieces[i - 1].size() == 0) {
-      if (prefix.size() > 0) {
-        return false;
+// Lists, for each english word, every (start offset, candidate index)
+// at which one of its non-NULL candidate translations occurs, by offset.
+static vector<vector<tuple<unsigned, unsigned> > > index_matches(
+    const vector<vector<const vector<unsigned>*> >& positions) {
+  vector<vector<tuple<unsigned, unsigned> > > matches(positions.size());
+  for (unsigned w = 0; w < positions.size(); ++w) {
+    for (unsigned c = 1; c < positions[w].size(); ++c) {
+      for (unsigned start : *positions[w][c]) {
+        matches[w].push_back(make_tuple(start, c));
       }
     }
-    else {
-      suffixes[permutation[i - 1]] = prefix;
+    sort(matches[w].begin(), matches[w].end());
+  }
+  return matches;
+}
+
+// Builds the derivation for a path of (start offset, word, candidate) pieces.
+// Each piece's suffix runs up to the start of the next piece, and the last
+// piece's suffix is the rest of the compound.
+static Derivation make_derivation(const string& german, const vector<vector<string> >& candidates,
+    const vector<tuple<unsigned, unsigned, unsigned> >& path) {
+  Derivation derivation;
+  derivation.translations.assign(candidates.size(), "");
+  derivation.suffixes.assign(candidates.size(), "");
+  for (unsigned k = 0; k < path.size(); ++k) {
+    const unsigned w = get<1>(path[k]);
+    const string& translation = candidates[w][get<2>(path[k])];
+    const unsigned end = get<0>(path[k]) + translation.size();
+    const unsigned next = (k + 1 < path.size()) ? get<0>(path[k + 1]) : german.size();
+    derivation.translations[w] = translation;
+    derivation.suffixes[w] = german.substr(end, next - end);
+    derivation.permutation.push_back(w);
+  }
+  return derivation;
+}
+
+// Walks the segmentation chart left to right. A chart item is a byte offset
+// just past the last piece placed plus the set of english words used so far.
+// From an item, any unused word may place one of its candidates at any
+// match starting at or after the offset (the skipped bytes become the
+// previous piece's suffix); the first piece must start at offset 0.
+// Every item with at least two pieces is a complete derivation.
+// If derivations is NULL, stops at the first complete one and returns true;
+// otherwise collects them all. visited memoizes items known to be dead ends.
+bool compound_analyzer::segment(const string& german, const vector<vector<string> >& candidates,
+    const vector<vector<tuple<unsigned, unsigned> > >& matches, unsigned offset, unsigned coverage,
+    vector<tuple<unsigned, unsigned, unsigned> >& path, vector<Derivation>* derivations,
+    unordered_set<uint64_t>& visited) {
+  bool found = false;
+  if (path.size() >= 2) {
+    if (derivations == NULL) {
+      return true;
     }
+    derivations->push_back(make_derivation(german, candidates, path));
+    found = true;
+  }
+
+  const uint64_t item = ((uint64_t)offset << 32) | coverage;
+  if (derivations == NULL && visited.count(item) > 0) {
+    return false;
+  }
 
-    assert (location + pieces[j].size() <= remainder.size());
-    remainder = remainder.substr(location + pieces[j].size());
+  const unsigned one = 1;
+  for (unsigned w = 0; w < matches.size(); ++w) {
+    if (coverage & (one << w)) {
+      continue;
+    }
+    auto it = lower_bound(matches[w].begin(), matches[w].end(), make_tuple(offset, 0u));
+    for (; it != matches[w].end(); ++it) {
+      const unsigned start = get<0>(*it);
+      const unsigned c = get<1>(*it);
+      if (path.size() == 0 && start != 0) {
+        break;
+      }
+      path.push_back(make_tuple(start, w, c));
+      found |= segment(german, candidates, matches, start + candidates[w][c].size(),
+          coverage | (one << w), path, derivations, visited);
+      path.pop_back();
+      if (found && derivations == NULL) {
+        return true;
+      }
+    }
   }
 
-  suffixes[permutation[permutation.size() - 1]] = remainder;
-  assert (suffixes.size() == pieces.size());
-  return true;
+  if (derivations == NULL) {
+    visited.insert(item);
+  }
+  return found;
 }
 
 vector<Derivation> compound_analyzer::analyze(const vector<string>& english, string german, bool verbose) {
@@ -63,19 +173,10 @@ vector<Derivation> compound_analyzer::analyze(const vector<string>& english, str
   // For each english word, look up its list of possible translations,
   // and filter the list down to just the translations that actually
   // appear in the german word we were given
+  map<string, vector<unsigned> > occurrences = find_pieces(german);
   vector<vector<string> > candidate_translations;
-  for (string w : english) {
-    map<string, double> translations = fwd_ttable->getTranslations(w);
-    vector<string> matching_translations;
-    matching_translations.push_back("");
-    for (auto kvp : translations) {
-      string t = kvp.first;
-      if (german.find(t) != string::npos) {
-        matching_translations.push_back(t);
-      }
-    }
-    candidate_translations.push_back(matching_translations);
-  }
+  vector<vector<const vector<unsigned>*> > candidate_positions;
+  find_candidates(english, occurrences, min_length, candidate_translations, candidate_positions);
 
   // Output the list of candidate translations for each english word
   // just for funsies
@@ -88,54 +189,13 @@ vector<Derivation> compound_analyzer::analyze(const vector<string>& english, str
     }
   }
 
-  // Loop over the cross product of possible translations
-  for (vector<string> translations : cross(candidate_translations)) {
-    // This variable will hold a permutation of the integers [0, |G|)
-    // Note that we remove indices coresponding to NULL translations
-    // since their ordering does not affect the output.
-    vector<unsigned> indices;
-    for (unsigned i = 0; i < translations.size(); ++i) {
-      if (translations[i] != "") {
-        indices.push_back(i);
-      }
-    }
-
-    // Don't allow all the pieces to translate as NULL
-    if (indices.size() == 0) {
-      continue;
-    }
-
-    // Loop over all possible permutations.
-    // Since we limit the English span length to 5, this
-    // loop will run at most 5! = 120 times.
-    do {
-      vector<string> suffixes;
-      if (!decompose(german, translations, indices, suffixes)) {
-        continue;
-      }
-
-      bool valid = true;
-      // Only allow derivations with at least two non-NULL pieces
-      // If it only has one non-NULL piece, then it's a WORD not a COMPOUND
-      valid &= (indices.size() >= 2);
-      // Only allow derivations where suffixes are <= 2 characters in length
-      /*for (string suffix : suffixes) {
-        if (suffix.size() > 2) {
-          valid = false;
-          break;
-        }
-      }*/
-
-      assert (translations.size() <= 5);
-      assert (suffixes.size() == translations.size());
-      assert (indices.size() <=  translations.size());
-      if (valid) {
-        Derivation derivation { translations, suffixes, indices };
-        derivations.push_back(derivation);
-      }
-
-    } while (next_permutation(indices.begin(), indices.end()));
-  }
+  // Only derivations with at least two non-NULL pieces are emitted.
+  // If one has only one non-NULL piece, then it's a WORD not a COMPOUND.
+  assert (english.size() <= max_words);
+  vector<vector<tuple<unsigned, unsigned> > > matches = index_matches(candidate_positions);
+  vector<tuple<unsigned, unsigned, unsigned> > path;
+  unordered_set<uint64_t> visited;
+  segment(german, candidate_translations, matches, 0, 0, path, &derivations, visited);
   return derivations;
 }
 
@@ -143,59 +203,14 @@ bool compound_analyzer::isReachable(const vector<string>& english, string german
   // For each english word, look up its list of possible translations,
   // and filter the list down to just the translations that actually
   // appear in the german word we were given
+  map<string, vector<unsigned> > occurrences = find_pieces(german);
   vector<vector<string> > candidate_translations;
-  for (string w : english) {
-    map<string, double> translations = fwd_ttable->getTranslations(w);
-    vector<string> matching_translations;
-    matching_translations.push_back("");
-    for (auto kvp : translations) {
-      string t = kvp.first;
-      if (t.size() >= 3 && german.find(t) != string::npos) {
-        matching_translations.push_back(t);
-      }
-    }
-    candidate_translations.push_back(matching_translations);
-  }
-
-  // Loop over the cross product of possible translations
-  for (vector<string> translations : cross(candidate_translations)) {
-
-    // This variable will hold a permutation of the integers [0, |G|)
-    // Note that we remove indices coresponding to NULL translations
-    // since their ordering does not affect the output.
-    vector<unsigned> indices;
-    for (unsigned i = 0; i < translations.size(); ++i) {
-      if (translations[i] != "") {
-        indices.push_back(i);
-      }
-    }
-
-    // Don't allow all the pieces to translate as NULL
-    if (indices.size() == 0) {
-      continue;
-    }
-
-    // Loop over all possible permutations.
-    // Since we limit the English span length to 5, this
-    // loop will run at most 5! = 120 times.
-    do {
-      vector<string> suffixes;
-      if (!decompose(german, translations, indices, suffixes)) {
-        continue;
-      }
-
-      bool valid = true;
-      // Only allow derivations with at least two non-NULL pieces
-      // If it only has one non-NULL piece, then it's a WORD not a COMPOUND
-      valid &= (indices.size() >= 2);
-      assert (suffixes.size() == translations.size());
-      if (valid) {
-        return true;
-      }
-
-    } while (next_permutation(indices.begin(), indices.end()));
-  }
-
-  return false;
+  vector<vector<const vector<unsigned>*> > candidate_positions;
+  find_candidates(english, occurrences, reachable_min_length, candidate_translations, candidate_positions);
+
+  assert (english.size() <= max_words);
+  vector<vector<tuple<unsigned, unsigned> > > matches = index_matches(candidate_positions);
+  vector<tuple<unsigned, unsigned, unsigned> > path;
+  unordered_set<uint64_t> visited;
+  return segment(german, candidate_translations, matches, 0, 0, path, NULL, visited);
 }
-
@@ -1,18 +1,45 @@
 #include <vector>
 #include <string>
+#include <map>
+#include <tuple>
+#include <cstdint>
+#include <unordered_set>
+#include "piece_matcher.h"
 #include "ttable.h"
 #include "utils.h"
 #include "derivation.h"
 using std::string;
 using std::vector;
+using std::map;
+using std::tuple;
+using std::unordered_set;
 
 class compound_analyzer {
 public:
   compound_analyzer(ttable* fwd_ttable);
-  bool decompose(string compound, const vector<string>& pieces,
-    vector<unsigned> permutation, vector<string>& suffixes);
   vector<Derivation> analyze(const vector<string>& english, string german, bool verbose = false);
   bool isReachable(const vector<string>& english, string german);
+
+  // Bumped whenever analyze may produce different derivations for the
+  // same input, so that cached analyses get rebuilt.
+  static const uint32_t version = 2;
+  // The shortest translations analyze and isReachable take as pieces
+  static const unsigned min_length = 1;
+  static const unsigned reachable_min_length = 3;
+  // The most English words analyze and isReachable take; coverage of
+  // the words is kept in a 32-bit mask. Callers skip longer lines.
+  static const unsigned max_words = 32;
+  // A hash of version and the parameters above, for keying caches
+  static uint64_t fingerprint();
 private:
+  map<string, vector<unsigned> > find_pieces(const string& german);
+  void find_candidates(const vector<string>& english, const map<string, vector<unsigned> >& occurrences,
+    unsigned min_length, vector<vector<string> >& candidates,
+    vector<vector<const vector<unsigned>*> >& positions);
+  bool segment(const string& german, const vector<vector<string> >& candidates,
+    const vector<vector<tuple<unsigned, unsigned> > >& matches, unsigned offset, unsigned coverage,
+    vector<tuple<unsigned, unsigned, unsigned> >& path, vector<Derivation>* derivations,
+    unordered_set<uint64_t>& visited);
   ttable* fwd_ttable;
+  piece_matcher matcher;
 };
@@ -0,0 +1,36 @@
+#include <iostream>
+#include <string>
+#include <cstdlib>
+#include "adept.h"
+#include "crf.h"
+#include "feature_scorer.h"
+#include "model_file.h"
+using namespace std;
+
+void ShowUsageAndExit(char** argv) {
+  cerr << "Usage: " << argv[0] << " old_model.crf new_model.crf [threshold suffix_margin]" << endl;
+  cerr << "Rewrites a model saved as a Boost text archive in the binary model format." << endl;
+  cerr << "With a threshold, also compacts it: features whose weights are at most threshold" << endl;
+  cerr << "in magnitude are dropped, as are suffixes scoring more than suffix_margin below the best a root may take." << endl;
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  if (argc != 3 && argc != 5) {
+    ShowUsageAndExit(argv);
+  }
+  adept::Stack stack;
+  if (model_file::is_binary(argv[1])) {
+    cerr << argv[1] << " is already a binary model." << endl;
+  }
+  // Only suffix features are ever scored here, and they need no ttables
+  feature_scorer scorer(NULL, NULL);
+  crf model = crf::ReadFromFile(&stack, &scorer, argv[1]);
+  if (argc == 5) {
+    model.compact(atof(argv[3]), atof(argv[4]));
+  }
+  model.WriteToFile(argv[2]);
+  cerr << "Wrote " << model.weights.size() << " features and " << model.suffix_list.size()
+       << " suffixes to " << argv[2] << "." << endl;
+  return 0;
+}
@@ -1,4 +1,5 @@
 #include <cassert>
+#include <cmath>
 #include <iostream>
 #include <algorithm>
 #include <set>
@@ -8,26 +9,12 @@
 #include <fstream>
 #include "NeuralLM/context.h"
 #include "crf.h"
+#include "model_file.h"
 using namespace std;
 
-namespace std {
-  template<>
-  struct hash<tuple<unsigned int, vector<unsigned>, Context> > {
-    hash<unsigned> uint_hash;
-    hash<Context> context_hash;
-    size_t operator()(const tuple<unsigned int, vector<unsigned>, Context>& t) const {
-      size_t seed = 0;
-      hash_combine(seed, get<0>(t));
-      for (unsigned i : get<1>(t)) {
-        hash_combine(seed, i);
-      }
-      hash_combine(seed, get<2>(t));
-      return seed;
-    }
-  };
-}
-
 const bool use_adadelta = true;
+// Update only the features each example used, instead of every weight
+const bool use_sparse_updates = true;
 
 // returns log(a * exp(x) + b * exp(y))
 adouble log_sum_exp(adouble x, adouble y, adouble a = 1.0, adouble b = 1.0) {
@@ -41,14 +28,23 @@ crf::crf(adept::Stack* stack, feature_scorer* scorer) {
 }
 
 adouble crf::dot(const map<string, double>& features, const map<string, adouble>& weights) {
+  if (mapped && &weights == &this->weights) {
+    return dot_value(features);
+  }
   adouble score = 0.0;
   for (auto& kvp : features) {
-    if (weights.find(kvp.first) == weights.end()) {
+    auto x = weights.find(kvp.first);
+    if (x == weights.end() && (compacted || ignore_unknown_features)) {
+      continue;
+    }
+    if (x == weights.end()) {
       cerr << "ERROR: Invalid attempt to use unknown feature \"" << kvp.first << "\"." << endl;
     }
-    assert(weights.find(kvp.first) != weights.end());
-    auto x = weights.find(kvp.first);
+    assert(x != weights.end());
     score += x->second * kvp.second;
+    if (tracking && &weights == &this->weights) {
+      active.push_back(&x->first);
+    }
   }
   return score;
 }
@@ -58,24 +54,279 @@ adouble crf::score(const vector<string>& x, const Derivation& y) {
   return dot(features, weights);
 }
 
+double crf::dot_value(const map<string, double>& features) const {
+  double score = 0.0;
+  if (mapped) {
+    for (auto& kvp : features) {
+      const unsigned i = mapped->find(kvp.first);
+      if (i == model_file::none && (compacted || ignore_unknown_features)) {
+        continue;
+      }
+      if (i == model_file::none) {
+        cerr << "ERROR: Invalid attempt to use unknown feature \"" << kvp.first << "\"." << endl;
+      }
+      assert(i != model_file::none);
+      score += mapped->weight(i) * kvp.second;
+    }
+    return score;
+  }
+  for (auto& kvp : features) {
+    auto x = weights.find(kvp.first);
+    if (x == weights.end() && (compacted || ignore_unknown_features)) {
+      continue;
+    }
+    assert(x != weights.end());
+    score += x->second.value() * kvp.second;
+  }
+  return score;
+}
+
+// Log of summed exp(permutation score) over all k! orders of k non-NULL words;
+// relies on score_permutation only telling monotone orders apart from the rest.
+double crf::permutation_mass(const vector<string>& x, unsigned k) {
+  assert (k <= x.size());
+  vector<unsigned> order(k);
+  for (unsigned j = 0; j < k; ++j) {
+    order[j] = j;
+  }
+  const double monotone = dot_value(scorer->score_permutation(x, order));
+  if (k < 2) {
+    return monotone;
+  }
+  swap(order[0], order[1]);
+  const double other = dot_value(scorer->score_permutation(x, order));
+  const double log_orders = lgamma(k + 1.0);
+  const double log_others = log_orders + log1p(-exp(-log_orders));
+  return log_sum_exp(vector<double> {monotone, other + log_others});
+}
+
+// Posterior marginals of each (translation, suffix) piece under the
+// LM-free model used by partition_function. The posterior of piece p for
+// word i is p(word i is not NULL) * exp(score(p) - word_partition_function(i)).
+// Everything is computed in plain double, so nothing is recorded.
+vector<vector<tuple<double, string, string> > > crf::piece_posteriors(const vector<string>& x) {
+  const unsigned n = x.size();
+  vector<vector<tuple<double, string, string> > > posteriors(n);
+  vector<double> word_scores(n);
+  vector<double> null_scores(n);
+  for (unsigned i = 0; i < n; ++i) {
+    const string& source = x[i];
+    vector<double> piece_scores;
+    for (auto& kvp : scorer->fwd_ttable->getTranslations(source)) {
+      const string& target = kvp.first;
+      map<string, double> translation_features = scorer->score_translation(source, target);
+      for (auto& lm : scorer->score_lm(target)) {
+        translation_features[lm.first] += lm.second;
+      }
+      const double translation_score = dot_value(translation_features);
+      for (const string& suffix : suffixes_for(target)) {
+        map<string, double> suffix_features = scorer->score_suffix(target, suffix);
+        for (auto& lm : scorer->score_lm(suffix)) {
+          suffix_features[lm.first] += lm.second;
+        }
+        const double piece_score = translation_score + dot_value(suffix_features);
+        posteriors[i].push_back(make_tuple(piece_score, target, suffix));
+        piece_scores.push_back(piece_score);
+      }
+    }
+    word_scores[i] = log_sum_exp(piece_scores);
+    null_scores[i] = dot_value(scorer->score_translation(source, ""))
+        + dot_value(scorer->score_suffix("", ""));
+  }
+
+  // The permutation score of a set of non-NULL words depends only on how
+  // many there are, so the sum over subsets is a forward-backward over the
+  // words whose state is the number of non-NULL words so far. forward[j][c]
+  // sums words 0..j-1 with c of them non-NULL, and backward[j][c] sums
+  // words j..n-1 with c of them non-NULL. This is O(n^3) where summing
+  // over subsets and orders, as partition_function does, is O(2^n n!).
+  vector<double> orders(n + 1);
+  for (unsigned k = 0; k <= n; ++k) {
+    orders[k] = permutation_mass(x, k);
+  }
+  vector<vector<double> > forward(n + 1);
+  forward[0].push_back(0.0);
+  for (unsigned j = 0; j < n; ++j) {
+    forward[j + 1].resize(j + 2);
+    for (unsigned c = 0; c <= j + 1; ++c) {
+      vector<double> terms;
+      if (c <= j) {
+        terms.push_back(forward[j][c] + null_scores[j]);
+      }
+      if (c > 0) {
+        terms.push_back(forward[j][c - 1] + word_scores[j]);
+      }
+      forward[j + 1][c] = log_sum_exp(terms);
+    }
+  }
+  vector<vector<double> > backward(n + 1);
+  backward[n].push_back(0.0);
+  for (unsigned j = n; j-- > 0; ) {
+    backward[j].resize(n - j + 1);
+    for (unsigned c = 0; c <= n - j; ++c) {
+      vector<double> terms;
+      if (c < n - j) {
+        terms.push_back(backward[j + 1][c] + null_scores[j]);
+      }
+      if (c > 0) {
+        terms.push_back(backward[j + 1][c - 1] + word_scores[j]);
+      }
+      backward[j][c] = log_sum_exp(terms);
+    }
+  }
+
+  vector<double> totals;
+  for (unsigned c = 0; c <= n; ++c) {
+    totals.push_back(forward[n][c] + orders[c]);
+  }
+  const double z = log_sum_exp(totals);
+
+  for (unsigned i = 0; i < n; ++i) {
+    vector<double> non_null;
+    for (unsigned a = 0; a <= i; ++a) {
+      for (unsigned b = 0; b < n - i; ++b) {
+        non_null.push_back(forward[i][a] + word_scores[i] + backward[i + 1][b] + orders[a + b + 1]);
+      }
+    }
+    const double log_non_null = log_sum_exp(non_null) - z;
+    for (auto& piece : posteriors[i]) {
+      get<0>(piece) = exp(log_non_null + get<0>(piece) - word_scores[i]);
+    }
+  }
+  return posteriors;
+}
+
+// The (local score, translation, suffix) pieces each source word may use in
+// the lattice. With piece_threshold > 0, pieces whose posterior under the
+// LM-free model is below the threshold are left out.
+vector<vector<tuple<adouble, string, string> > > crf::lattice_pieces(const vector<string>& x) {
+  kept_pieces = 0;
+  pruned_pieces = 0;
+  pruned_piece_mass = 0.0;
+  vector<vector<tuple<double, string, string> > > candidates;
+  if (piece_threshold > 0.0) {
+    candidates = piece_posteriors(x);
+  }
+  else {
+    candidates.resize(x.size());
+    for (unsigned i = 0; i < x.size(); ++i) {
+      for (auto& kvp : scorer->fwd_ttable->getTranslations(x[i])) {
+        for (const string& suffix : suffixes_for(kvp.first)) {
+          candidates[i].push_back(make_tuple(1.0, kvp.first, suffix));
+        }
+      }
+    }
+  }
+
+  vector<vector<tuple<adouble, string, string> > > pieces(x.size());
+  for (unsigned i = 0; i < x.size(); ++i) {
+    for (auto& candidate : candidates[i]) {
+      const double posterior = get<0>(candidate);
+      const string& translation = get<1>(candidate);
+      const string& suffix = get<2>(candidate);
+      if (posterior < piece_threshold) {
+        pruned_pieces++;
+        pruned_piece_mass += posterior;
+        continue;
+      }
+      kept_pieces++;
+      map<string, double> translation_features = scorer->score_translation(x[i], translation);
+      map<string, double> suffix_features = scorer->score_suffix(translation, suffix);
+      adouble local_score = dot(translation_features, weights) + dot(suffix_features, weights);
+      pieces[i].push_back(make_tuple(local_score, translation, suffix));
+    }
+  }
+  return pieces;
+}
+
+bool crf::has_budget() const {
+  return max_expansions != 0 || max_lm_queries != 0 ||
+    deadline != chrono::steady_clock::time_point::max();
+}
+
+// Checks the anytime budget, setting approximate once it has run out.
+// queries is the number of LM queries the current call has made.
+bool crf::over_budget(unsigned queries) {
+  if (!approximate) {
+    approximate = (max_expansions != 0 && expansions >= max_expansions) ||
+      (max_lm_queries != 0 && queries >= max_lm_queries) ||
+      (deadline != chrono::steady_clock::time_point::max() && chrono::steady_clock::now() >= deadline);
+  }
+  return approximate;
+}
+
+// Drops states from one step of the lattice before it is expanded.
+// States are ranked by forward score; at most size survive (0 = no limit),
+// and only those within threshold of the best one.
+// The survivors are left in states and from_scores, best first.
+void crf::prune(vector<unsigned>& states, vector<adouble>& from_scores, unsigned size, double threshold) {
+  assert (states.size() == from_scores.size());
+  if (states.size() == 0) {
+    return;
+  }
+  vector<unsigned> order(states.size());
+  for (unsigned i = 0; i < order.size(); ++i) {
+    order[i] = i;
+  }
+  stable_sort(order.begin(), order.end(), [&](unsigned a, unsigned b) {
+    return from_scores[a].value() > from_scores[b].value();
+  });
+
+  const double best = from_scores[order[0]].value();
+  unsigned keep = 1;
+  while (keep < order.size() && (size == 0 || keep < size) &&
+      from_scores[order[keep]].value() >= best - threshold) {
+    ++keep;
+  }
+
+  if (keep < order.size()) {
+    vector<double> mass;
+    for (unsigned i : order) {
+      mass.push_back(from_scores[i].value());
+    }
+    const double total = log_sum_exp(mass.data(), mass.size());
+    const double kept = log_sum_exp(mass.data(), keep);
+    pruning_error += total - kept;
+    pruned_states += order.size() - keep;
+  }
+
+  vector<unsigned> kept_states;
+  vector<adouble> kept_scores;
+  for (unsigned i = 0; i < keep; ++i) {
+    kept_states.push_back(states[order[i]]);
+    kept_scores.push_back(from_scores[order[i]]);
+  }
+  states.swap(kept_states);
+  from_scores.swap(kept_scores);
+}
+
 adouble crf::lattice_partition_function(const vector<string>& x) {
   // a state is a coverage bitvector, a list of used source indices, and a context
   // the bit vector includes words that translate to NULL
   // but the vector of indices does not
-  typedef tuple<unsigned, vector<unsigned>, Context> state;
   const unsigned unk = scorer->lm_vocab->convert("<unk>");
   const unsigned eos = scorer->lm_vocab->convert("</s>");
   const unsigned one = 1;
 
-  unordered_map<state, vector<adouble>> scores;
-  unordered_map<unsigned, unordered_set<state> > states_by_step;
-  for (unsigned i = 0; i < x.size() + 1; ++i) {
-    states_by_step[i] = unordered_set<state>();
-  } 
+  vector<vector<tuple<adouble, string, string> > > pieces = lattice_pieces(x);
+  vector<vector<vector<unsigned> > > piece_letters(x.size());
+  vector<vector<unsigned> > piece_ids(x.size());
+  unsigned num_pieces = 0;
+  for (unsigned i = 0; i < x.size(); ++i) {
+    for (const auto& piece : pieces[i]) {
+      piece_ids[i].push_back(num_pieces++);
+      vector<unsigned> letters;
+      for (const string& letter : feature_scorer::split_utf8(get<1>(piece) + get<2>(piece))) {
+        letters.push_back(scorer->lm_vocab->lookup(letter, unk));
+      }
+      piece_letters[i].push_back(letters);
+    }
+  }
 
+  lattice.reset(x.size() + 1);
   Context start_context(scorer->lm->context_size());
   start_context.init(scorer->lm_vocab->lookup("<s>", 0));
-  vector<unsigned> empty_coverage;
+  const unsigned start = lattice.add_context(start_context);
   for (unsigned null_coverage = 0; null_coverage < (one << x.size()); ++null_coverage) { 
     adouble score = 0.0;
     for (unsigned int i = 0; i < x.size(); ++i) {
@@ -86,63 +337,116 @@ adouble crf::lattice_partition_function(const vector<string>& x) {
         score += local_score;
       }
     }
-    state start_state = make_tuple(null_coverage, empty_coverage, start_context);
-    scores[start_state].push_back(score);
-    states_by_step[popCount(null_coverage)].insert(start_state);
+    unsigned start_state = lattice.add_state(popCount(null_coverage), null_coverage, 0, start);
+    lattice.incoming(start_state).push_back(score);
   }
 
+  const adouble& lm_weight = weights["lm_score"];
+  if (tracking) {
+    active.push_back(&weights.find("lm_score")->first);
+  }
+  pruned_states = 0;
+  pruning_error = 0.0;
+  expansions = 0;
+  approximate = false;
+  const bool budgeted = has_budget();
+  vector<adouble> from_scores;
+  id_table walks;
   for (unsigned int step = 0; step < x.size(); ++step) {
-    for (const state& from_state : states_by_step[step]) {
-      adouble from_score = log_sum_exp(scores[from_state]);
-      unsigned coverage = get<0>(from_state);
+    vector<unsigned>& step_states = lattice.states(step);
+    from_scores.clear();
+    for (unsigned from_state : step_states) {
+      from_scores.push_back(log_sum_exp(lattice.incoming(from_state)));
+    }
+    if (budgeted && over_budget(lattice.num_transitions())) {
+      prune(step_states, from_scores, 1, numeric_limits<double>::infinity());
+    }
+    else if (budgeted || beam_size != 0 || beam_threshold != numeric_limits<double>::infinity()) {
+      // Under a budget, states are also sorted so that the best are expanded first
+      prune(step_states, from_scores, beam_size, beam_threshold);
+    }
+
+    if (lattice_threads > 1) {
+      // Score the LM transitions this step needs in parallel, so the loop
+      // below finds all of them already in the store.
+      vector<unsigned> walk_contexts;
+      vector<const vector<unsigned>*> walk_letters;
+      walks.clear();
+      for (unsigned from_state : step_states) {
+        const unsigned context = lattice.context_of(from_state);
+        const unsigned coverage = lattice.coverage(from_state);
+        for (unsigned i = 0; i < x.size(); ++i) {
+          if (coverage & (one << i)) {
+            continue;
+          }
+          for (unsigned p = 0; p < pieces[i].size(); ++p) {
+            const uint64_t key = ((uint64_t)context << 32) | piece_ids[i][p];
+            if (walks.find(key) == id_table::none) {
+              walks.insert(key, walk_contexts.size());
+              walk_contexts.push_back(context);
+              walk_letters.push_back(&piece_letters[i][p]);
+            }
+          }
+        }
+      }
+      if (!lattice_pool || lattice_pool->size() != lattice_threads) {
+        lattice_pool.reset(new thread_pool(lattice_threads));
+      }
+      lattice.add_transitions(walk_contexts, walk_letters, scorer->lm, *lattice_pool);
+    }
+
+    for (unsigned k = 0; k < step_states.size(); ++k) {
+      if (budgeted && k > 0 && over_budget(lattice.num_transitions())) {
+        // Give up on the rest of this step; the states are sorted, so
+        // the best one has already been expanded.
+        prune(step_states, from_scores, k, numeric_limits<double>::infinity());
+        break;
+      }
+      expansions++;
+      const unsigned from_state = step_states[k];
+      const adouble& from_score = from_scores[k];
+      unsigned coverage = lattice.coverage(from_state);
       assert (popCount(coverage) == step);
       for (unsigned int i = 0; i < x.size(); ++i) {
         if (coverage & (one << i)) {
           continue;
         } 
-        for (const auto& pair : scorer->fwd_ttable->getTranslations(x[i])) {
-          const string& translation = get<0>(pair);
-          for (const string& suffix : suffix_list) {
-            map<string, double> translation_features = scorer->score_translation(x[i], translation);
-            map<string, double> suffix_features = scorer->score_suffix(translation, suffix);
-            adouble local_score = dot(translation_features, weights) + dot(suffix_features, weights);
-
-            adouble lm_score = 0.0;
-            vector<unsigned> new_coverage = get<1>(from_state);
-            new_coverage.push_back(i);
-            Context new_context = get<2>(from_state);
-            for (const string& letter : feature_scorer::split_utf8(translation + suffix)) {
-              const unsigned letter_id = scorer->lm_vocab->lookup(letter, unk);
-              lm_score += scorer->lm->log_prob(new_context, letter_id);
-              new_context.add(letter_id);
-            }
-            state new_state = make_tuple(coverage | (one << i), new_coverage, new_context);
-            assert (popCount(get<0>(new_state)) == step + 1);
-            states_by_step[step + 1].insert(new_state);
-            scores[new_state].push_back(from_score + local_score + lm_score * weights["lm_score"]);
+        const unsigned new_permutation = lattice.extend_permutation(lattice.permutation_of(from_state), i);
+        for (unsigned p = 0; p < pieces[i].size(); ++p) {
+          const adouble& local_score = get<0>(pieces[i][p]);
+          adouble lm_score = 0.0;
+          unsigned context = lattice.context_of(from_state);
+          for (unsigned letter : piece_letters[i][p]) {
+            const unsigned t = lattice.transition(context, letter, scorer->lm);
+            lm_score += lattice.transition_log_prob(t);
+            context = lattice.transition_target(t);
           }
+          unsigned new_state = lattice.add_state(step + 1, coverage | (one << i), new_permutation, context);
+          assert (popCount(lattice.coverage(new_state)) == step + 1);
+          lattice.incoming(new_state).push_back(from_score + local_score + lm_score * lm_weight);
         }
       }
     }
   }
 
   vector<adouble> final_scores;
-  for (const state& final_state : states_by_step[x.size()]) {
-    unsigned coverage = get<0>(final_state);
+  for (unsigned final_state : lattice.states(x.size())) {
+    unsigned coverage = lattice.coverage(final_state);
     assert (popCount(coverage) == x.size());
     assert (coverage < (one << x.size()));
 
-    vector<unsigned> permutation = get<1>(final_state);
+    vector<unsigned> permutation = lattice.permutation(lattice.permutation_of(final_state));
     adouble permutation_score = dot(scorer->score_permutation(x, permutation), weights);
 
-    Context context = get<2>(final_state);
+    const Context& context = lattice.context(lattice.context_of(final_state));
     adouble lm_score = scorer->lm->log_prob(context, eos);
 
-    adouble final_score = log_sum_exp(scores[final_state]);
-    final_score += lm_score * weights["lm_score"];
+    adouble final_score = log_sum_exp(lattice.incoming(final_state));
+    final_score += lm_score * lm_weight;
     final_score += permutation_score;
     final_scores.push_back(final_score);
   }
+  lm_queries = lattice.num_transitions();
   return log_sum_exp(final_scores);
 }
 
@@ -161,7 +465,7 @@ adouble crf::word_partition_function(const string& source) {
     }
 
     vector<adouble> suffix_scores;
-    for (string suffix : suffix_list) {
+    for (const string& suffix : suffixes_for(target)) {
       map<string, double> suffix_features = scorer->score_suffix(target, suffix);
       for (auto kvp : scorer->score_lm(suffix)) {
         suffix_features[kvp.first] += kvp.second;
@@ -252,9 +556,18 @@ adouble crf::slow_partition_function(const vector<string>& x, const map<string,
   assert(candidate_translations.size() == x.size());
 
 
-  vector<Derivation> derivations;
+  // Derivations are scored as they are enumerated, so only the
+  // scores are held in memory.
+  vector<adouble> scores;
+  Derivation derivation;
+  derivation.translations.resize(x.size());
   // Loop over the cross product of possible translations
-  for (vector<string> translations : cross(candidate_translations)) {
+  for (odometer it(candidate_translations); !it.done(); it.next()) {
+    vector<string>& translations = derivation.translations;
+    for (unsigned i = 0; i < translations.size(); ++i) {
+      translations[i] = candidate_translations[i][it.indices()[i]];
+    }
+
     // This variable will hold a permutation of the integers [0, |G|)
     // Note that we remove indices coresponding to NULL translations
     // since their ordering does not affect the output.
@@ -265,53 +578,27 @@ adouble crf::slow_partition_function(const vector<string>& x, const map<string,
       }
     }
 
-    // Don't allow all the pieces to translate as NULL
-    /*if (indices.size() == 0) {
-      continue;
-    }*/
-
-    vector<vector<string> > candidate_suffixes;
-    for (unsigned i = 0; indices.size() > 0 && i < indices.size() - 1; ++i) {
-      vector<string> suffixes;
-      for (string suffix : suffix_list) {
-        suffixes.push_back(suffix);
-      }
-      candidate_suffixes.push_back(suffixes);
-    }
-
-    // The last iteration is split since eventually the last suffix
-    // will be drawn from a different table
-    if (indices.size() > 0)
-    {
-      vector<string> suffixes; 
-      for (string suffix : suffix_list) {
-        suffixes.push_back(suffix);
-      }
-      candidate_suffixes.push_back(suffixes);
-    }
-    assert(candidate_suffixes.size() == indices.size());
+    // Every non-NULL piece may take any suffix.
+    // Eventually the last suffix will be drawn from a different table.
+    vector<string> suffix_choices(suffix_list.begin(), suffix_list.end());
+    vector<unsigned> suffix_sizes(indices.size(), suffix_choices.size());
 
     // Loop over all possible permutations.
     do { 
-      for (vector<string> chosen_suffixes : cross(candidate_suffixes)) {
-        vector<string> suffixes(translations.size(), string(""));
+      for (odometer chosen_suffixes(suffix_sizes); !chosen_suffixes.done(); chosen_suffixes.next()) {
+        derivation.suffixes.assign(translations.size(), string(""));
         for (unsigned i = 0; i < indices.size(); ++i) {
-          suffixes[indices[i]] = chosen_suffixes[i];
+          derivation.suffixes[indices[i]] = suffix_choices[chosen_suffixes.indices()[i]];
         } 
+        derivation.permutation = indices;
 
-        assert(suffixes.size() == translations.size());
-        Derivation derivation { translations, suffixes, indices };
-        derivations.push_back(derivation);
+        assert(derivation.suffixes.size() == translations.size());
+        map<string, double> features = scorer->score(x, derivation);
+        scores.push_back(dot(features, weights));
       }
     } while (next_permutation(indices.begin(), indices.end()));
   }
 
-  vector<adouble> scores;
-  for (Derivation d : derivations) {
-    map<string, double> features = scorer->score(x, d);
-    scores.push_back(dot(features, weights)); 
-  }
-
   return log_sum_exp(scores);
 }
 
@@ -365,6 +652,57 @@ adouble crf::l2penalty(const double lambda) {
   return res;
 }
 
+adouble crf::train_example(const vector<string>& x, const vector<Derivation>& y,
+    double learning_rate, double l2_strength) {
+  assert (!mapped);
+  adouble log_loss = 0.0;
+  stack->new_recording();
+  active.clear();
+  tracking = use_sparse_updates;
+  adouble d = lattice_partition_function(x);
+  /*vector<adouble> scores;
+  for (unsigned int j = 0; j < y.size(); ++j) {
+    scores.push_back(score(x, y[j]));
+  }
+  adouble log_total = log_sum_exp(scores);
+  log_loss -= log_total - d;*/
+
+  adouble score_sum = 0.0;
+  for (unsigned int j = 0; j < y.size(); ++j) {
+    score_sum += exp(score(x, y[j]));
+  }
+  tracking = false;
+  log_loss -= log(score_sum) - d;
+  if (!use_sparse_updates) {
+    log_loss += l2penalty(l2_strength);
+  }
+
+  log_loss.set_gradient(1.0);
+  stack->compute_adjoint();
+  ++updates;
+  idle_l2_strength = l2_strength;
+  if (!use_sparse_updates) {
+    for (auto& fv : weights) {
+      fv.second += step(fv.first, fv.second.value(), fv.second.get_gradient(), learning_rate, 0.0);
+    }
+    return log_loss;
+  }
+
+  // Every other feature has zero loss gradient, and step catches up on
+  // the decay of their AdaDelta averages and on their L1 and L2 shrinkage
+  // when they are next used (or catch_up does).
+  sort(active.begin(), active.end());
+  active.erase(unique(active.begin(), active.end()), active.end());
+  double penalty = 0.0;
+  for (const string* name : active) {
+    adouble& w = weights.find(*name)->second;
+    const double value = w.value();
+    penalty += l2_strength * value * value + l1_strength * fabs(value);
+    w += step(*name, value, w.get_gradient() + 2.0 * l2_strength * value, learning_rate, 0.0);
+  }
+  return log_loss + penalty;
+}
+
 adouble crf::train_nobatch(const vector<vector<string> >& x, const vector<vector<Derivation> >& y,
     double learning_rate, double l2_strength) {
   assert(x.size() == y.size());
@@ -372,41 +710,33 @@ adouble crf::train_nobatch(const vector<vector<string> >& x, const vector<vector
   for (unsigned i = 0; i < x.size(); ++i) {
     cerr << i << "/" << x.size() << "\r";
     cerr.flush();
-    adouble log_loss = 0.0;
-    stack->new_recording();
-    adouble d = lattice_partition_function(x[i]);
-    /*vector<adouble> scores;
-    for (unsigned int j = 0; j < y[i].size(); ++j) {
-      scores.push_back(score(x[i], y[i][j]));
-    }
-    adouble log_total = log_sum_exp(scores);
-    log_loss -= log_total - d;*/
+    total_log_loss += train_example(x[i], y[i], learning_rate, l2_strength);
+  }
+  cerr << x.size() << "/" << x.size() << endl;
+  catch_up();
 
-    adouble score_sum = 0.0;
-    for (unsigned int j = 0; j < y[i].size(); ++j) {
-      score_sum += exp(score(x[i], y[i][j]));
-    }
-    log_loss -= log(score_sum) - d;
-    log_loss += l2penalty(l2_strength);
+  return total_log_loss;
+}
 
-    log_loss.set_gradient(1.0);
-    stack->compute_adjoint();
-    for (auto& fv : weights) {
-      const double g = fv.second.get_gradient();
-      double delta;
-      if (use_adadelta) {
-        historical_gradients[fv.first] = rho * historical_gradients[fv.first] + (1 - rho) * g * g;
-        delta = -g * sqrt(historical_deltas[fv.first]) / sqrt(historical_gradients[fv.first]);
-        historical_deltas[fv.first] = rho * historical_deltas[fv.first] + (1 - rho) * delta * delta;
-      }
-      else {
-        delta = -g * learning_rate;
-      }
-      weights[fv.first] += delta;
+// Same as above, but the reference derivations are kept compact and
+// only expanded one example at a time.
+adouble crf::train_nobatch(const vector<vector<string> >& x, const vector<vector<CompactDerivation> >& y,
+    const string_pool& pool, double learning_rate, double l2_strength) {
+  assert(x.size() == y.size());
+  adouble total_log_loss = 0.0;
+  vector<Derivation> expanded;
+  for (unsigned i = 0; i < x.size(); ++i) {
+    cerr << i << "/" << x.size() << "\r";
+    cerr.flush();
+    expanded.clear();
+    expanded.reserve(y[i].size());
+    for (const CompactDerivation& d : y[i]) {
+      expanded.push_back(d.expand(pool));
     }
-    total_log_loss += log_loss;
+    total_log_loss += train_example(x[i], expanded, learning_rate, l2_strength);
   }
   cerr << x.size() << "/" << x.size() << endl;
+  catch_up();
 
   return total_log_loss;
 }
@@ -438,18 +768,9 @@ adouble crf::train(const vector<vector<string> >& x, const vector<vector<Derivat
 
   log_loss.set_gradient(1.0);
   stack->compute_adjoint();
+  ++updates;
   for (auto& fv : weights) {
-    const double g = fv.second.get_gradient();
-    double delta;
-    if (use_adadelta) {
-      historical_gradients[fv.first] = rho * historical_gradients[fv.first] + (1 - rho) * g * g;
-      delta = -g * sqrt(historical_deltas[fv.first]) / sqrt(historical_gradients[fv.first]);
-      historical_deltas[fv.first] = rho * historical_deltas[fv.first] + (1 - rho) * delta * delta;
-    }
-    else {
-      delta = -g * learning_rate;
-    }
-    weights[fv.first] += delta;
+    fv.second += step(fv.first, fv.second.value(), fv.second.get_gradient(), learning_rate, 0.0);
   }
 
   return log_loss;
@@ -473,18 +794,9 @@ adouble crf::train(const vector<vector<string> >& x, const vector<Derivation>& y
 
   log_loss.set_gradient(1.0);
   stack->compute_adjoint();
+  ++updates;
   for (auto& fv : weights) {
-    const double g = fv.second.get_gradient();
-    double delta;
-    if (use_adadelta) {
-      historical_gradients[fv.first] = rho * historical_gradients[fv.first] + (1 - rho) * g * g;
-      delta = -g * sqrt(historical_deltas[fv.first]) / sqrt(historical_gradients[fv.first]);
-      historical_deltas[fv.first] = rho * historical_deltas[fv.first] + (1 - rho) * delta * delta;
-    }
-    else {
-      delta = -g * learning_rate;
-    }
-    weights[fv.first] += delta;
+    fv.second += step(fv.first, fv.second.value(), fv.second.get_gradient(), learning_rate, 0.0);
   }
 
   return log_loss;
@@ -502,28 +814,322 @@ adouble crf::train(const vector<vector<string> >& x, const vector<Derivation>& y
 
   log_loss.set_gradient(1.0);
   stack->compute_adjoint();
+  ++updates;
   for (auto& fv : weights) {
-    const double g = fv.second.get_gradient();
-    double delta;
-    if (use_adadelta) {
-      historical_gradients[fv.first] = rho * historical_gradients[fv.first] + (1 - rho) * g * g;
-      delta = -g * sqrt(historical_deltas[fv.first] + epsilon) / sqrt(historical_gradients[fv.first] + epsilon);
-      historical_deltas[fv.first] = rho * historical_deltas[fv.first] + (1 - rho) * delta * delta;
+    fv.second += step(fv.first, fv.second.value(), fv.second.get_gradient(), learning_rate, epsilon);
+  }
+
+  return log_loss;
+}
+
+// One AdaDelta (or SGD) update of the feature name, whose weight is w,
+// given its gradient g. A feature is only brought up to date when it is
+// updated, so it first catches up on every earlier update in which it was
+// idle. Its loss gradient was zero in those, so all they did was decay
+// its averages by rho and shrink it by the L2 and L1 penalties (see
+// shrink_idle). The gradient step is likewise followed by the
+// proximal step, which moves the weight toward zero by its learning rate
+// times l1_strength, and stops at zero.
+double crf::step(const string& name, double w, double g, double learning_rate, double epsilon) {
+  auto it = accumulators.find(name);
+  if (it == accumulators.end()) {
+    it = accumulators.insert(make_pair(name, accumulator())).first;
+    it->second.gradients = 1.0;
+    it->second.deltas = 1.0;
+    it->second.last_update = updates - 1;
+    it->second.rate = 0.0;
+  }
+  accumulator& a = it->second;
+  const unsigned idle = updates - 1 - a.last_update;
+  const double caught_up = shrink_idle(w, a, idle);
+  a.last_update = updates;
+  if (!use_adadelta) {
+    a.rate = learning_rate;
+    return caught_up - w + proximal(caught_up, -g * learning_rate, learning_rate);
+  }
+  if (idle > 0) {
+    const double decay = pow(rho, idle);
+    a.gradients *= decay;
+    a.deltas *= decay;
+  }
+  a.gradients = rho * a.gradients + (1 - rho) * g * g;
+  const double rate = sqrt(a.deltas + epsilon) / sqrt(a.gradients + epsilon);
+  const double delta = proximal(caught_up, -g * rate, rate);
+  a.deltas = rho * a.deltas + (1 - rho) * delta * delta;
+  a.rate = sqrt(a.deltas + epsilon) / sqrt(rho * a.gradients + epsilon);
+  return caught_up - w + delta;
+}
+
+// The weight w of a feature after the idle updates that followed its
+// last one, cumulative-penalty style. In each, the L2 penalty's gradient
+// step scales w by 1 - 2 * idle_l2_strength * rate, and the L1 proximal
+// step then moves it toward zero by rate * l1_strength, stopping at zero.
+// With the step size held at the one its last update left, which is what
+// it stays at while both averages decay, idle such updates sum to a
+// geometric series.
+double crf::shrink_idle(double w, const accumulator& a, unsigned idle) const {
+  if (idle == 0) {
+    return w;
+  }
+  const double scale = 1.0 - 2.0 * idle_l2_strength * a.rate;
+  if (scale <= 0.0) {
+    return 0.0;
+  }
+  const double shrink = a.rate * l1_strength;
+  const double scale_k = pow(scale, idle);
+  const double total_shrink = (scale == 1.0) ? idle * shrink : shrink * (1.0 - scale_k) / (1.0 - scale);
+  const double magnitude = scale_k * fabs(w) - total_shrink;
+  return (magnitude > 0.0) ? copysign(magnitude, w) : 0.0;
+}
+
+// The step size of an idle update for averages that weren't left by an
+// update of their own. For AdaDelta it follows from them; SGD's learning
+// rate isn't known until the feature's next update.
+double crf::idle_rate(const accumulator& a) const {
+  return (use_adadelta && a.gradients > 0.0) ? sqrt(a.deltas) / sqrt(rho * a.gradients) : 0.0;
+}
+
+void crf::catch_up() {
+  for (auto& kvp : accumulators) {
+    accumulator& a = kvp.second;
+    const unsigned idle = updates - a.last_update;
+    if (idle == 0) {
+      continue;
+    }
+    auto w = weights.find(kvp.first);
+    if (w != weights.end()) {
+      w->second = shrink_idle(w->second.value(), a, idle);
+    }
+    const double decay = pow(rho, idle);
+    a.gradients *= decay;
+    a.deltas *= decay;
+    a.last_update = updates;
+  }
+}
+
+// Adds the losses of examples first, first + stride, ... to loss and
+// their gradients to gradient. Each example is recorded on its own, and
+// only the features it used are read back.
+void crf::add_gradients(const vector<vector<string> >& x, const vector<vector<CompactDerivation> >& y,
+    const string_pool& pool, size_t first, size_t stride, double& loss, vector<double>& gradient) {
+  unordered_map<const string*, unsigned> index;
+  unsigned i = 0;
+  for (auto& kvp : weights) {
+    index[&kvp.first] = i++;
+  }
+
+  vector<Derivation> expanded;
+  for (size_t j = first; j < x.size(); j += stride) {
+    stack->new_recording();
+    active.clear();
+    tracking = true;
+    adouble d = lattice_partition_function(x[j]);
+    adouble score_sum = 0.0;
+    for (const CompactDerivation& compact : y[j]) {
+      score_sum += exp(score(x[j], compact.expand(pool)));
+    }
+    tracking = false;
+    adouble log_loss = d - log(score_sum);
+    log_loss.set_gradient(1.0);
+    stack->compute_adjoint();
+    loss += log_loss.value();
+
+    sort(active.begin(), active.end());
+    active.erase(unique(active.begin(), active.end()), active.end());
+    for (const string* name : active) {
+      gradient[index[name]] += weights.find(*name)->second.get_gradient();
+    }
+  }
+}
+
+double crf::objective(const vector<vector<string> >& x, const vector<vector<CompactDerivation> >& y,
+    const string_pool& pool, double l2_strength, thread_pool& threads, vector<double>& gradient) {
+  assert(!mapped);
+  assert(x.size() == y.size());
+  const size_t chunks = max(threads.size(), 1u);
+  vector<double> losses(chunks, 0.0);
+  vector<vector<double> > gradients(chunks);
+  if (chunks == 1) {
+    gradients[0].assign(weights.size(), 0.0);
+    add_gradients(x, y, pool, 0, 1, losses[0], gradients[0]);
+  }
+  else {
+    threads.run(chunks, [&](size_t c) {
+      // A stack can only be active on one thread, so each worker records
+      // on a stack and model of its own, both gone before it returns.
+      adept::Stack worker_stack;
+      crf model = clone(&worker_stack);
+      model.lattice_threads = 1;
+      gradients[c].assign(weights.size(), 0.0);
+      model.add_gradients(x, y, pool, c, chunks, losses[c], gradients[c]);
+    });
+  }
+
+  double loss = 0.0;
+  gradient.assign(weights.size(), 0.0);
+  for (size_t c = 0; c < chunks; ++c) {
+    loss += losses[c];
+    for (size_t i = 0; i < gradient.size(); ++i) {
+      gradient[i] += gradients[c][i];
+    }
+  }
+  unsigned i = 0;
+  for (auto& kvp : weights) {
+    const double w = kvp.second.value();
+    loss += l2_strength * w * w;
+    gradient[i++] += 2.0 * l2_strength * w;
+  }
+  return loss;
+}
+
+void crf::get_weights(vector<double>& w) const {
+  w.clear();
+  w.reserve(weights.size());
+  for (auto& kvp : weights) {
+    w.push_back(kvp.second.value());
+  }
+}
+
+void crf::set_weights(const vector<double>& w) {
+  assert(w.size() == weights.size());
+  unsigned i = 0;
+  for (auto& kvp : weights) {
+    kvp.second = w[i++];
+  }
+}
+
+// The change to a weight w from a gradient step delta taken at the given
+// learning rate, followed by the proximal step for the L1 penalty
+double crf::proximal(double w, double delta, double rate) const {
+  if (l1_strength == 0.0) {
+    return delta;
+  }
+  const double moved = w + delta;
+  const double shrink = rate * l1_strength;
+  if (moved > shrink) {
+    return moved - shrink - w;
+  }
+  if (moved < -shrink) {
+    return moved + shrink - w;
+  }
+  return -w;
+}
+
+// Features with zero weight are dropped first. A suffix's own score, its
+// feature weight plus the length feature's cost, is the same next to any
+// root; the LM is the only other thing that scores it, so a suffix more
+// than suffix_margin below the best suffix a root may take loses to it
+// for that root, short of an LM preference of that size. Suffixes are
+// pruned like that for each ending in root_suffixes, and against every
+// suffix for the roots it backs off for, and are only dropped from the
+// model once no root may take them.
+void crf::compact(double threshold, double suffix_margin) {
+  assert (!mapped);
+  compacted = true;
+  for (auto it = weights.begin(); it != weights.end(); ) {
+    if (fabs(it->second.value()) <= threshold) {
+      accumulators.erase(it->first);
+      it = weights.erase(it);
     }
     else {
-      delta = -g * learning_rate;
+      ++it;
     }
-    weights[fv.first] += delta;
   }
 
-  return log_loss;
+  unordered_map<string, double> scores;
+  double best = -numeric_limits<double>::infinity();
+  for (const string& suffix : suffix_list) {
+    scores[suffix] = dot_value(scorer->score_suffix("", suffix));
+    best = max(best, scores[suffix]);
+  }
+  root_suffixes.prune(scores, suffix_margin);
+  // Roots the index backs off for may take any suffix in suffix_list
+  const bool any_root = root_suffixes.empty() || root_suffixes.back_off;
+  for (auto it = suffix_list.begin(); it != suffix_list.end(); ) {
+    if (it->size() > 0 && !(any_root && scores[*it] >= best - suffix_margin) && !root_suffixes.allows(*it)) {
+      weights.erase("suffix_" + *it);
+      accumulators.erase("suffix_" + *it);
+      it = suffix_list.erase(it);
+    }
+    else {
+      ++it;
+    }
+  }
+  all_suffixes_stale = true;
+}
+
+void crf::save_state(training_state& state) const {
+  // Checkpoints hold the weights and averages as of now, with any pending
+  // L1 shrinkage and decay applied
+  state.weights.clear();
+  for (auto& kvp : weights) {
+    auto a = accumulators.find(kvp.first);
+    const double w = kvp.second.value();
+    state.weights.emplace_hint(state.weights.end(), kvp.first,
+      (a == accumulators.end()) ? w : shrink_idle(w, a->second, updates - a->second.last_update));
+  }
+  state.historical_deltas.clear();
+  state.historical_gradients.clear();
+  for (auto& kvp : accumulators) {
+    const double decay = pow(rho, updates - kvp.second.last_update);
+    state.historical_deltas.emplace_hint(state.historical_deltas.end(), kvp.first, kvp.second.deltas * decay);
+    state.historical_gradients.emplace_hint(state.historical_gradients.end(), kvp.first, kvp.second.gradients * decay);
+  }
+  state.suffixes.assign(suffix_list.begin(), suffix_list.end());
+}
+
+void crf::restore_state(const training_state& state) {
+  weights.clear();
+  for (auto& kvp : state.weights) {
+    weights.emplace_hint(weights.end(), kvp.first, kvp.second);
+  }
+  assert (state.historical_deltas.size() == state.historical_gradients.size());
+  accumulators.clear();
+  auto g = state.historical_gradients.begin();
+  for (auto& kvp : state.historical_deltas) {
+    assert (g->first == kvp.first);
+    accumulator& a = accumulators.emplace_hint(accumulators.end(), kvp.first, accumulator())->second;
+    a.deltas = kvp.second;
+    a.gradients = g->second;
+    a.last_update = updates;
+    a.rate = idle_rate(a);
+    ++g;
+  }
+  suffix_list.clear();
+  suffix_list.insert(state.suffixes.begin(), state.suffixes.end());
+  all_suffixes_stale = true;
+}
+
+// The suffixes root may take: those root_suffixes allows, or every suffix
+// in suffix_list if the index is empty or backs off for this root. Those
+// are copied into all_suffixes when it's first needed and again after
+// anything that changes suffix_list marks it stale.
+const vector<string>& crf::suffixes_for(const string& root) const {
+  const vector<string>* allowed = root_suffixes.empty() ? NULL : root_suffixes.find(root);
+  if (allowed != NULL) {
+    return *allowed;
+  }
+  if (all_suffixes_stale) {
+    all_suffixes.assign(suffix_list.begin(), suffix_list.end());
+    all_suffixes_stale = false;
+  }
+  return all_suffixes;
+}
+
+void crf::add_suffix(const string& suffix) {
+  if (suffix_list.insert(suffix).second) {
+    all_suffixes_stale = true;
+  }
 }
 
 void crf::add_feature(string name) {
   if (weights.find(name) == weights.end()) {
     weights[name] = 0.0;
-    historical_deltas[name] = 1.0;
-    historical_gradients[name] = 1.0;
+    accumulator& a = accumulators[name];
+    a.deltas = 1.0;
+    a.gradients = 1.0;
+    a.last_update = updates;
+    a.rate = idle_rate(a);
   }
 }
 
@@ -548,7 +1154,13 @@ Derivation crf::combine(const vector<string>& x, const vector<unsigned>& indices
 
 vector<tuple<double, Derivation> > crf::predict(const vector<string>& x, unsigned k) {
   bool verbose = false;
-  suffix_list.insert("");
+  add_suffix("");
+  expansions = 0;
+  // predict scores pieces with the ttables and suffix features only, so
+  // it makes no LM queries and max_lm_queries never stops it
+  lm_queries = 0;
+  approximate = false;
+  const bool budgeted = has_budget();
   // First we find the k-best (translation, suffix) pairs for each index in x
   vector<vector<tuple<adouble, string, string> > > best_pieces;
   for (unsigned i = 0; i < x.size(); ++i) {
@@ -557,21 +1169,41 @@ vector<tuple<double, Derivation> > crf::predict(const vector<string>& x, unsigne
 
     string source = x[i];
     vector<string> translation_list;
-    translation_list.push_back("");
-    for (auto kvp : scorer->fwd_ttable->getTranslations(source)) {
-      translation_list.push_back(kvp.first);
+    if (!budgeted) {
+      translation_list.push_back("");
+      for (auto kvp : scorer->fwd_ttable->getTranslations(source)) {
+        translation_list.push_back(kvp.first);
+      }
+    }
+    else {
+      // Under a budget the likeliest translations are scored first and
+      // NULL last. Once the budget runs out the rest are skipped, but each
+      // word still gets its first translation and the NULL piece.
+      vector<pair<double, string> > by_score;
+      for (auto kvp : scorer->fwd_ttable->getTranslations(source)) {
+        by_score.push_back(make_pair(kvp.second, kvp.first));
+      }
+      sort(by_score.rbegin(), by_score.rend());
+      for (auto& translation : by_score) {
+        translation_list.push_back(translation.second);
+      }
+      translation_list.push_back("");
     }
 
     for (string target : translation_list) {
+      if (budgeted && target.size() > 0 && local_best_pieces.size() > 0 && over_budget(0)) {
+        continue;
+      }
       map<string, double> translation_features = scorer->score_translation(source, target);
       adouble translation_score = dot(translation_features, weights);
-      for (string suffix : suffix_list) {
+      for (const string& suffix : suffixes_for(target)) {
         if (target.size() == 0 && suffix.size() != 0) {
           continue;
         }
         map<string, double> suffix_features = scorer->score_suffix(target, suffix);
         adouble suffix_score = dot(suffix_features, weights);
         adouble total_score = suffix_score + translation_score;
+        expansions++;
         if (local_best_pieces.size() < k ||
             total_score > get<0>(local_best_pieces[local_best_pieces.size() - 1])) {
           local_best_pieces.push_back(make_tuple(total_score, target, suffix));
@@ -613,6 +1245,10 @@ vector<tuple<double, Derivation> > crf::predict(const vector<string>& x, unsigne
   // TODO: Right now the list of candidates may be substantially bigger
   // than it needs to be.
   while (candidates.size() > 0 && kbest.size() < k) {
+    if (budgeted && kbest.size() > 0 && over_budget(0)) {
+      break;
+    }
+    expansions++;
     // Pop the best candidate from the list and unpack it
     auto best_candidate = *(candidates.rbegin());
     vector<unsigned> indices;
@@ -669,11 +1305,31 @@ vector<tuple<double, Derivation> > crf::predict(const vector<string>& x, unsigne
 
 crf::crf() {}
 
+// Reads either format: binary models (see model_file) are mapped and
+// copied into the weight map in one pass, in feature name order, and
+// anything else is read as a Boost text archive from older versions.
 crf crf::ReadFromFile(adept::Stack* stack, feature_scorer* scorer, const string& filename) {
   crf model;
-  ifstream ifs(filename);
-  boost::archive::text_iarchive ia(ifs);
-  ia & model;
+  if (model_file::is_binary(filename)) {
+    model_file file;
+    if (!file.open(filename)) {
+      cerr << "ERROR: Unable to read model from " << filename << "." << endl;
+      exit(1);
+    }
+    for (unsigned i = 0; i < file.num_features(); ++i) {
+      model.weights.emplace_hint(model.weights.end(), file.feature(i), file.weight(i));
+    }
+    for (unsigned i = 0; i < file.num_suffixes(); ++i) {
+      model.add_suffix(file.suffix(i));
+    }
+    model.compacted = file.compacted();
+    model.root_suffixes = file.index();
+  }
+  else {
+    ifstream ifs(filename);
+    boost::archive::text_iarchive ia(ifs);
+    ia & model;
+  }
 
   model.stack = stack;
   model.scorer = scorer;
@@ -681,8 +1337,54 @@ crf crf::ReadFromFile(adept::Stack* stack, feature_scorer* scorer, const string&
   return model;
 }
 
+crf crf::MapFromFile(adept::Stack* stack, feature_scorer* scorer, const string& filename) {
+  if (!model_file::is_binary(filename)) {
+    crf model = ReadFromFile(stack, scorer, filename);
+    model.ignore_unknown_features = true;
+    return model;
+  }
+  shared_ptr<model_file> file(new model_file());
+  if (!file->open(filename)) {
+    cerr << "ERROR: Unable to read model from " << filename << "." << endl;
+    exit(1);
+  }
+  crf model(stack, scorer);
+  model.ignore_unknown_features = true;
+  for (unsigned i = 0; i < file->num_suffixes(); ++i) {
+    model.add_suffix(file->suffix(i));
+  }
+  model.compacted = file->compacted();
+  model.root_suffixes = file->index();
+  // The lattice refers to the LM weight directly rather than through dot
+  const unsigned lm = file->find("lm_score");
+  model.weights["lm_score"] = (lm == model_file::none) ? 0.0 : file->weight(lm);
+  model.mapped = file;
+  return model;
+}
+
+crf crf::clone(adept::Stack* stack) const {
+  crf model(stack, scorer);
+  for (auto& kvp : weights) {
+    model.weights[kvp.first] = kvp.second.value();
+  }
+  model.suffix_list = suffix_list;
+  model.accumulators = accumulators;
+  model.updates = updates;
+  model.compacted = compacted;
+  model.ignore_unknown_features = ignore_unknown_features;
+  model.root_suffixes = root_suffixes;
+  model.l1_strength = l1_strength;
+  model.beam_size = beam_size;
+  model.beam_threshold = beam_threshold;
+  model.lattice_threads = lattice_threads;
+  model.piece_threshold = piece_threshold;
+  model.max_expansions = max_expansions;
+  model.max_lm_queries = max_lm_queries;
+  model.mapped = mapped;
+  return model;
+}
+
 void crf::WriteToFile(const string& filename) const {
-  ofstream ofs(filename);
-  boost::archive::text_oarchive oa(ofs);
-  oa & *this;
+  assert (!mapped);
+  model_file::write(filename, weights, suffix_list, root_suffixes, compacted);
 }
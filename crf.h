@@ -2,7 +2,11 @@
 #include <vector>
 #include <string>
 #include <map>
+#include <memory>
 #include <tuple>
+#include <limits>
+#include <chrono>
+#include <unordered_set>
 #include <boost/serialization/map.hpp>
 #include <boost/serialization/unordered_set.hpp>
 #include <boost/archive/text_oarchive.hpp>
@@ -11,16 +15,25 @@
 #include "derivation.h"
 #include "utils.h"
 #include "feature_scorer.h"
+#include "state_store.h"
+#include "checkpoint.h"
+#include "thread_pool.h"
+#include "suffix_index.h"
 using std::string;
 using std::vector;
 using std::map;
 using std::tuple;
+using std::unordered_set;
 using adept::adouble;
 
+class model_file;
+
 class crf {
 public:
   crf(adept::Stack* stack, feature_scorer* scorer);
   adouble dot(const map<string, double>& features, const map<string, adouble>& weights);
+  // Same as dot with this model's weights, in plain double
+  double dot_value(const map<string, double>& features) const;
   adouble score(const vector<string>& x, const Derivation& y);
   adouble word_partition_function(const string& source);
   adouble partition_function(const vector<string>& x);
@@ -32,16 +45,99 @@ public:
 
   adouble l2penalty(const double lambda);
   adouble train_nobatch(const vector<vector<string>>& x, const vector<vector<Derivation> >& z, double learning_rate, double l2_strength);
+  adouble train_nobatch(const vector<vector<string>>& x, const vector<vector<CompactDerivation> >& z, const string_pool& pool, double learning_rate, double l2_strength);
+  // One AdaDelta (or SGD) step on a single example; returns its loss
+  adouble train_example(const vector<string>& x, const vector<Derivation>& y, double learning_rate, double l2_strength);
+  // Copies the weights, suffix list and optimizer accumulators out of or
+  // back into the model. The rest of state is up to the caller.
+  void save_state(training_state& state) const;
+  void restore_state(const training_state& state);
+  // Sparse updates leave the features an example doesn't use alone (see
+  // step). This applies the L1 and L2 shrinkage and decay each has missed
+  // since its last update, so the weights are those dense updates would give.
+  void catch_up();
+  // The batch training objective at the current weights: the negative log
+  // likelihood of the reference derivations plus the L2 penalty. Fills
+  // gradient with its gradient, one entry per feature in name order. The
+  // examples are split among the threads of pool, each of which works on
+  // its own clone of the model.
+  double objective(const vector<vector<string> >& x, const vector<vector<CompactDerivation> >& y,
+    const string_pool& pool, double l2_strength, thread_pool& threads, vector<double>& gradient);
+  // The weights as a vector in feature name order, for batch optimizers
+  void get_weights(vector<double>& w) const;
+  void set_weights(const vector<double>& w);
   adouble train(const vector<vector<string>>& x, const vector<vector<Derivation> >& z, double learning_rate, double l2_strength);
   adouble train(const vector<vector<string>>& x, const vector<Derivation>& z, double learning_rate, double l2_strength);
   adouble train(const vector<vector<string>>& x, const vector<Derivation>& z, const vector<vector<Derivation> >& noise_samples, double learning_rate, double l2_strength);
   void add_feature(string name);
+  void add_suffix(const string& suffix);
+  // Drops every feature whose weight is at most threshold in magnitude,
+  // and prunes the suffixes whose own score is more than suffix_margin
+  // below the best one a root may take, with their features once no root
+  // may take them. Features missing from a compacted model have weight
+  // zero, instead of being an error.
+  void compact(double threshold, double suffix_margin);
+  bool compacted = false;
+  // Set by MapFromFile. Inputs to a trained model may have words it never
+  // saw, whose features (such as word_to_null) it has no weight for; they
+  // get weight zero, as in a compacted model.
+  bool ignore_unknown_features = false;
+  // The L1 penalty the online trainers apply with proximal updates. With
+  // the L2 strength passed to them this gives the elastic net.
+  double l1_strength = 0.0;
 
   Derivation combine(const vector<string>& x, const vector<unsigned>& indices,
     const vector<vector<tuple<adouble, string, string> > >& best_pieces,
     const vector<unsigned>& permutation);
   vector<tuple<double, Derivation> > predict(const vector<string>& x, unsigned k=1);
 
+  // Approximate search for lattice_partition_function. Before each step
+  // is expanded, at most beam_size of its states are kept (0 = no limit),
+  // and states whose forward score is more than beam_threshold below the
+  // best state of the step are dropped.
+  unsigned beam_size = 0;
+  double beam_threshold = std::numeric_limits<double>::infinity();
+  // Filled in by each lattice_partition_function call: the number of
+  // states dropped, and an estimate of how far the returned log partition
+  // function falls below the exact one. The estimate sums, over steps,
+  // log(total forward mass / kept forward mass), which is exact if dropped
+  // states would have had the same completions as the kept ones.
+  unsigned pruned_states = 0;
+  double pruning_error = 0.0;
+
+  // Number of threads lattice_partition_function uses to score the LM
+  // transitions of each step. Worker threads keep only the values of the
+  // LM scores, which is all the gradients of weights depend on, and the
+  // result is bit-for-bit the same for any thread count.
+  unsigned lattice_threads = 1;
+
+  // Coarse-to-fine pruning for lattice_partition_function: (translation,
+  // suffix) pieces whose posterior under the LM-free model is below
+  // piece_threshold are left out of the lattice (0 keeps everything).
+  // Each call reports how many pieces were kept and pruned, and the total
+  // LM-free posterior of the pruned ones.
+  double piece_threshold = 0.0;
+  unsigned kept_pieces = 0;
+  unsigned pruned_pieces = 0;
+  double pruned_piece_mass = 0.0;
+  vector<vector<tuple<double, string, string> > > piece_posteriors(const vector<string>& x);
+
+  // Anytime search for predict and lattice_partition_function. A call
+  // stops taking on new work once the clock passes deadline, or after
+  // max_expansions expansions within the call (0 = no limit). Only
+  // lattice_partition_function queries the LM, so max_lm_queries (0 = no
+  // limit) only stops it. predict then returns the best derivations found
+  // so far; lattice_partition_function finishes by following only the
+  // best state of each remaining step, counting what it drops in
+  // pruned_states and pruning_error. Each call reports the work it did
+  // and sets approximate if the budget ran out.
+  std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+  unsigned max_expansions = 0;
+  unsigned max_lm_queries = 0;
+  unsigned expansions = 0;
+  unsigned lm_queries = 0;
+  bool approximate = false;
+
   friend class boost::serialization::access;
   template<class Archive>
   void serialize(Archive& ar, const unsigned int version) {
@@ -49,16 +145,69 @@ public:
     ar & suffix_list;
   }
   static crf ReadFromFile(adept::Stack* stack, feature_scorer* scorer, const string& filename);
+  // A read-only model for decoding. A binary model file is mapped and its
+  // weights are looked up there by binary search, so loading builds no
+  // weight map and clones share the mapping. Such a model cannot be
+  // trained, compacted or saved, and features it has no weight for score
+  // zero. Text archives fall back to ReadFromFile.
+  static crf MapFromFile(adept::Stack* stack, feature_scorer* scorer, const string& filename);
+  // A copy of this model for another thread. Call it on the thread that
+  // will use the copy, with that thread's stack active: the weights are
+  // re-created from their values on it, so the two models share nothing
+  // on any tape. The copy must also be destroyed on that thread.
+  crf clone(adept::Stack* stack) const;
   void WriteToFile(const string& filename) const;
 //private:
   map<string, adouble> weights;
+  // Add to it with add_suffix, which keeps suffixes_for up to date
   unordered_set<string> suffix_list;
+  // Restricts the suffixes each root may take in the lattice, the
+  // partition functions and predict. While it is empty, every root takes
+  // every suffix in suffix_list.
+  suffix_index root_suffixes;
 private:
   crf();
+  vector<vector<tuple<adouble, string, string> > > lattice_pieces(const vector<string>& x);
+  double permutation_mass(const vector<string>& x, unsigned k);
+  void prune(vector<unsigned>& states, vector<adouble>& from_scores, unsigned size, double threshold);
+  bool has_budget() const;
+  bool over_budget(unsigned queries);
+  double step(const string& name, double w, double g, double learning_rate, double epsilon);
+  double proximal(double w, double delta, double rate) const;
+  const vector<string>& suffixes_for(const string& root) const;
+  void add_gradients(const vector<vector<string> >& x, const vector<vector<CompactDerivation> >& y,
+    const string_pool& pool, size_t first, size_t stride, double& loss, vector<double>& gradient);
   adept::Stack* stack;
   feature_scorer* scorer;
-  map<string, double> historical_deltas;
-  map<string, double> historical_gradients;
+  state_store lattice;
+  // Workers for add_transitions, started the first time lattice_threads > 1
+  std::shared_ptr<thread_pool> lattice_pool;
+  // suffix_list as a vector, for suffixes_for, rebuilt there when stale
+  mutable vector<string> all_suffixes;
+  mutable bool all_suffixes_stale = true;
+  // Set for a model from MapFromFile, whose weights live in the file
+  std::shared_ptr<const model_file> mapped;
+  // AdaDelta's decayed averages of one feature's squared gradients and
+  // squared updates, as of the update numbered last_update (see step), and
+  // the step size the updates after that one would take.
+  struct accumulator {
+    double gradients;
+    double deltas;
+    unsigned last_update;
+    double rate;
+  };
+  map<string, accumulator> accumulators;
+  double shrink_idle(double w, const accumulator& a, unsigned idle) const;
+  double idle_rate(const accumulator& a) const;
+  // The L2 strength of the last train_example, which idle features catch
+  // up with
+  double idle_l2_strength = 0.0;
+  // Number of optimizer updates made so far
+  unsigned updates = 0;
+  // While tracking is set, dot records in active the name of every one of
+  // this model's features it uses, so only those need to be updated.
+  bool tracking = false;
+  vector<const string*> active;
   const double rho = 0.95;
   const double epsilon = 1.0e-6;
 };
@@ -0,0 +1,114 @@
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <string>
+#include <sstream>
+#include <vector>
+#include <chrono>
+#include <cassert>
+#include <cstdlib>
+#include <limits>
+#include <thread>
+
+#include "adept.h"
+#include "crf.h"
+#include "decoding.h"
+#include "feature_scorer.h"
+#include "line_pipeline.h"
+#include "utils.h"
+#include "derivation.h"
+using namespace std;
+using adept::adouble;
+
+void ShowUsageAndExit(char** argv) {
+  cerr << "Usage: " << argv[0] << " model.crf fwd_ttable rev_ttable target.vcb target.nlm [k] [threads] [budget_ms] [beam_size] [beam_threshold] < input" << endl;
+  cerr << "where each line of input is an English span to translate into a compound" << endl;
+  cerr << "beam_size and beam_threshold prune the lattice's partition function (see crf::beam_size)" << endl;
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 6) {
+    ShowUsageAndExit(argv);
+  }
+  const unsigned k = (argc > 6) ? atoi(argv[6]) : 10;
+  const unsigned num_threads = (argc > 7) ? atoi(argv[7]) : thread::hardware_concurrency();
+  const double budget_ms = (argc > 8) ? atof(argv[8]) : 0.0;
+  const unsigned beam_size = (argc > 9) ? atoi(argv[9]) : 0;
+  const double beam_threshold = (argc > 10) ? atof(argv[10]) : numeric_limits<double>::infinity();
+  ios_base::sync_with_stdio(false);
+
+  typedef chrono::steady_clock clock;
+  const clock::time_point load_start = clock::now();
+
+  cerr << "Loading ttables..." << endl;
+  ttable fwd_ttable;
+  ttable rev_ttable;
+  fwd_ttable.load(argv[2]);
+  rev_ttable.load(argv[3]);
+
+  cerr << "Loading LM..." << endl;
+  adept::Stack stack;
+  vocabulary lm_vocab = vocabulary::ReadFromFile(argv[4]);
+  NeuralLM lm = NeuralLM::ReadFromFile(argv[5]);
+
+  feature_scorer scorer(&fwd_ttable, &rev_ttable);
+  scorer.lm_vocab = &lm_vocab;
+  scorer.lm = &lm;
+
+  cerr << "Loading model..." << endl;
+  crf model = crf::MapFromFile(&stack, &scorer, argv[1]);
+  // predict adds the empty suffix itself; adding it here keeps the
+  // workers' copies from each modifying their suffix list mid-run.
+  model.add_suffix("");
+  model.beam_size = beam_size;
+  model.beam_threshold = beam_threshold;
+
+  const double load_seconds = chrono::duration<double>(clock::now() - load_start).count();
+  cerr << "Loaded in " << load_seconds << " seconds." << endl;
+
+  // Per-input latencies, in milliseconds, kept separately by each worker
+  vector<vector<double> > latencies(num_threads > 0 ? num_threads : 1);
+  // Number of inputs that ran out of budget, also kept by each worker
+  vector<size_t> budget_hits(latencies.size(), 0);
+  line_pipeline pipeline(num_threads, 16);
+  pipeline.run(cin, cout, [&](unsigned worker, size_t line_number, const string& line, string& output) {
+    thread_local unique_ptr<decoder_state> state;
+    if (!state) {
+      state.reset(new decoder_state(model));
+    }
+
+    const clock::time_point start = clock::now();
+    vector<string> input;
+    string error;
+    if (!read_span(line, input, error)) {
+      cerr << "Skipping line " << line_number << ": " << error << "." << endl;
+      return;
+    }
+    if (decode(*state, &scorer, line_number, input, k, budget_ms, output)) {
+      budget_hits[worker]++;
+    }
+    latencies[worker].push_back(chrono::duration<double, milli>(clock::now() - start).count());
+  });
+
+  vector<double> all_latencies;
+  for (const vector<double>& l : latencies) {
+    all_latencies.insert(all_latencies.end(), l.begin(), l.end());
+  }
+  cerr << "Load time: " << load_seconds << " s" << endl;
+  cerr << "Decoded " << all_latencies.size() << " inputs in " << pipeline.seconds << " s" << endl;
+  cerr << "Latency per input (ms): p50 " << percentile(all_latencies, 50.0)
+       << ", p90 " << percentile(all_latencies, 90.0)
+       << ", p99 " << percentile(all_latencies, 99.0)
+       << ", max " << percentile(all_latencies, 100.0) << endl;
+  if (budget_ms > 0.0) {
+    size_t hits = 0;
+    for (size_t h : budget_hits) {
+      hits += h;
+    }
+    cerr << "Budget of " << budget_ms << " ms ran out on " << hits << " inputs" << endl;
+  }
+
+  return 0;
+}
@@ -0,0 +1,67 @@
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <sstream>
+#include "decoding.h"
+#include "utils.h"
+using namespace std;
+
+bool read_span(const string& line, vector<string>& input, string& error) {
+  stringstream sstream(line);
+  string word;
+  while (sstream >> word) {
+    input.push_back(to_lower_case(word));
+  }
+  if (input.size() == 0 || input.size() > 5) {
+    error = "inputs must have between 1 and 5 words";
+    return false;
+  }
+  return true;
+}
+
+bool decode(decoder_state& state, feature_scorer* scorer, size_t line_number,
+    const vector<string>& input, unsigned k, double budget_ms, string& output) {
+  crf& model = state.model;
+  if (budget_ms > 0.0) {
+    const chrono::duration<double, milli> budget(budget_ms);
+    model.deadline = chrono::steady_clock::now() + chrono::duration_cast<chrono::steady_clock::duration>(budget);
+  }
+  // The k-best list is what the caller asked for, so it is searched first
+  // and the lattice for the probabilities gets whatever budget is left.
+  state.stack.new_recording();
+  vector<tuple<double, Derivation> > kbest = model.predict(input, k);
+  bool approximate = model.approximate;
+  const double log_z = model.lattice_partition_function(input).value();
+  approximate = approximate || model.approximate;
+
+  const string prefix = to_string(line_number) + " ||| ";
+  const char* flag = approximate ? " ||| approximate\n" : " ||| exact\n";
+  char number[32];
+  for (unsigned i = 0; i < kbest.size(); ++i) {
+    const Derivation& derivation = get<1>(kbest[i]);
+    const double score = model.dot_value(scorer->score(input, derivation));
+
+    output += prefix;
+    output += to_string(i);
+    output += " ||| ";
+    output += derivation.toString();
+    output += " |||";
+    for (unsigned j : derivation.permutation) {
+      output += ' ';
+      output += derivation.translations[j];
+      output += '+';
+      output += derivation.suffixes[j];
+    }
+    output += " |||";
+    for (unsigned j : derivation.permutation) {
+      output += ' ';
+      output += to_string(j);
+    }
+    snprintf(number, sizeof(number), " ||| %g", score);
+    output += number;
+    snprintf(number, sizeof(number), " ||| %g", score - log_z);
+    output += number;
+    output += flag;
+  }
+  return approximate;
+}
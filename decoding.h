@@ -0,0 +1,31 @@
+#pragma once
+#include <string>
+#include <vector>
+#include "adept.h"
+#include "crf.h"
+#include "feature_scorer.h"
+using std::string;
+using std::vector;
+
+// Everything a worker thread needs to run the model on its own: Adept
+// keeps one active stack per thread, so each worker gets a stack and a
+// copy of the model whose weights live on it. Both must be created and
+// destroyed on the worker's thread.
+struct decoder_state {
+  decoder_state(const crf& shared) : model(shared.clone(&stack)) {}
+  adept::Stack stack;
+  crf model;
+};
+
+// Splits a line into a lower-cased English span. Returns false, with the
+// reason in error, if the model cannot decode it.
+bool read_span(const string& line, vector<string>& input, string& error);
+
+// Appends the k-best list for one input: for each candidate,
+// line ||| rank ||| compound ||| pieces ||| permutation ||| score ||| log probability ||| exact
+// With budget_ms > 0, the whole input gets that many milliseconds (see
+// crf::deadline), spent first on the k-best search and then on the
+// partition function; if it runs out, the last field is "approximate" instead.
+// Returns whether the budget ran out.
+bool decode(decoder_state& state, feature_scorer* scorer, size_t line_number,
+    const vector<string>& input, unsigned k, double budget_ms, string& output);
@@ -0,0 +1,66 @@
+#include <iostream>
+#include <cassert>
+#include <cmath>
+#include <cstdio>
+#include <map>
+#include <string>
+#include <vector>
+#include "adept.h"
+#include "crf.h"
+#include "derivation.h"
+#include "feature_scorer.h"
+#include "ttable.h"
+using namespace std;
+
+// Checks that a model loaded for decoding scores inputs with words it
+// never saw in training, giving their features weight zero. Run with
+// "make test"; asserts fail loudly if anything is wrong.
+
+int main(int argc, char** argv) {
+  const string filename = "decoding_test.crf";
+  adept::Stack stack;
+  ttable fwd_ttable;
+  ttable rev_ttable;
+  fwd_ttable.setScore("tomato", "tomate", -0.5);
+  rev_ttable.setScore("tomate", "tomato", -0.25);
+  feature_scorer scorer(&fwd_ttable, &rev_ttable);
+
+  crf trained(&stack, &scorer);
+  const char* names[] = {"length", "fwd_score", "rev_score", "tgt_null", "null_score", "monotone",
+    "suffix_", "suffix_n", "tomato_to_null"};
+  double w = 0.5;
+  for (const char* name : names) {
+    trained.add_feature(name);
+    trained.weights[name] = w;
+    w -= 0.25;
+  }
+  trained.add_suffix("");
+  trained.add_suffix("n");
+  trained.WriteToFile(filename);
+
+  // "red" was not in the training data, so the model has no red_to_null
+  Derivation derivation;
+  derivation.translations = {"", "tomate"};
+  derivation.suffixes = {"", "n"};
+  derivation.permutation = {1};
+  const vector<string> input = {"red", "tomato"};
+  map<string, double> features = scorer.score(input, derivation);
+  assert (features.count("red_to_null") == 1);
+  double expected = 0.0;
+  for (auto& kvp : features) {
+    auto it = trained.weights.find(kvp.first);
+    if (it != trained.weights.end()) {
+      expected += it->second.value() * kvp.second;
+    }
+  }
+
+  crf model = crf::MapFromFile(&stack, &scorer, filename);
+  const double score = model.dot_value(features);
+  assert (fabs(score - expected) < 1.0e-12);
+  crf copy = model.clone(&stack);
+  assert (fabs(copy.dot(features, copy.weights).value() - expected) < 1.0e-12);
+
+  remove(filename.c_str());
+  cerr << "decoding_test: unseen words score as weight zero" << endl;
+  return 0;
+}
@@ -1,5 +1,5 @@
-#include <sstream>
 #include <cassert>
+#include <cstring>
 #include <iostream>
 #include "derivation.h"
 using namespace std;
@@ -7,14 +7,136 @@ using namespace std;
 string Derivation::toString() const {
   assert (translations.size() == suffixes.size());
   assert (translations.size() >= permutation.size());
-  stringstream ss;
+  string s;
   for (unsigned j : permutation) {
     assert (j < translations.size());
-    ss << translations[j] << suffixes[j];
+    s += translations[j];
+    s += suffixes[j];
   }
-  return ss.str();
+  return s;
 }
 
 string Derivation::toLongString() const { return "tLS"; }
 
 string Derivation::toLongString(map<string, double> features) const { return "tLS(f)"; }
+
+unsigned string_pool::intern(const string& s) {
+  auto it = ids.find(s);
+  if (it != ids.end()) {
+    return it->second;
+  }
+  const unsigned id = strings.size();
+  strings.push_back(s);
+  ids[s] = id;
+  return id;
+}
+
+const string& string_pool::get(unsigned id) const {
+  assert (id < strings.size());
+  return strings[id];
+}
+
+unsigned string_pool::size() const {
+  return strings.size();
+}
+
+const unsigned CompactDerivation::max_pieces;
+
+// Unused slots are zeroed so that equality can compare whole arrays.
+CompactDerivation::CompactDerivation() : num_words(0), num_pieces(0) {
+  memset(translations, 0, sizeof(translations));
+  memset(suffixes, 0, sizeof(suffixes));
+  memset(words, 0, sizeof(words));
+}
+
+CompactDerivation::CompactDerivation(const Derivation& derivation, string_pool& pool) : CompactDerivation() {
+  assert (derivation.translations.size() == derivation.suffixes.size());
+  assert (derivation.translations.size() < 256);
+  assert (derivation.permutation.size() <= max_pieces);
+  num_words = derivation.translations.size();
+  num_pieces = derivation.permutation.size();
+  for (unsigned i = 0; i < num_pieces; ++i) {
+    const unsigned j = derivation.permutation[i];
+    words[i] = j;
+    translations[i] = pool.intern(derivation.translations[j]);
+    suffixes[i] = pool.intern(derivation.suffixes[j]);
+  }
+}
+
+Derivation CompactDerivation::expand(const string_pool& pool) const {
+  Derivation derivation;
+  derivation.translations.assign(num_words, "");
+  derivation.suffixes.assign(num_words, "");
+  for (unsigned i = 0; i < num_pieces; ++i) {
+    derivation.translations[words[i]] = pool.get(translations[i]);
+    derivation.suffixes[words[i]] = pool.get(suffixes[i]);
+    derivation.permutation.push_back(words[i]);
+  }
+  return derivation;
+}
+
+string CompactDerivation::toString(const string_pool& pool) const {
+  string s;
+  for (unsigned i = 0; i < num_pieces; ++i) {
+    s += pool.get(translations[i]);
+    s += pool.get(suffixes[i]);
+  }
+  return s;
+}
+
+unsigned CompactDerivation::size() const {
+  return num_pieces;
+}
+
+unsigned CompactDerivation::word(unsigned i) const {
+  assert (i < num_pieces);
+  return words[i];
+}
+
+unsigned CompactDerivation::translation(unsigned i) const {
+  assert (i < num_pieces);
+  return translations[i];
+}
+
+unsigned CompactDerivation::suffix(unsigned i) const {
+  assert (i < num_pieces);
+  return suffixes[i];
+}
+
+bool CompactDerivation::operator==(const CompactDerivation& other) const {
+  return num_words == other.num_words && num_pieces == other.num_pieces &&
+      memcmp(words, other.words, sizeof(words)) == 0 &&
+      memcmp(translations, other.translations, sizeof(translations)) == 0 &&
+      memcmp(suffixes, other.suffixes, sizeof(suffixes)) == 0;
+}
+
+bool CompactDerivation::operator<(const CompactDerivation& other) const {
+  if (num_words != other.num_words) {
+    return num_words < other.num_words;
+  }
+  if (num_pieces != other.num_pieces) {
+    return num_pieces < other.num_pieces;
+  }
+  for (unsigned i = 0; i < num_pieces; ++i) {
+    if (words[i] != other.words[i]) {
+      return words[i] < other.words[i];
+    }
+    if (translations[i] != other.translations[i]) {
+      return translations[i] < other.translations[i];
+    }
+    if (suffixes[i] != other.suffixes[i]) {
+      return suffixes[i] < other.suffixes[i];
+    }
+  }
+  return false;
+}
+
+size_t CompactDerivation::hash() const {
+  uint64_t h = ((uint64_t)num_words << 8) | num_pieces;
+  for (unsigned i = 0; i < num_pieces; ++i) {
+    h = (h ^ words[i]) * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ translations[i]) * 0x9e3779b97f4a7c15ULL;
+    h = (h ^ suffixes[i]) * 0x9e3779b97f4a7c15ULL;
+  }
+  return h ^ (h >> 32);
+}
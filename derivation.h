@@ -1,7 +1,9 @@
 #pragma once
+#include <cstdint>
 #include <vector>
 #include <string>
 #include <map>
+#include <unordered_map>
 using namespace std;
 
 class Derivation {
@@ -14,3 +16,54 @@ public:
   string toLongString() const;
   string toLongString(map<string, double> features) const;
 };
+
+// Interns strings, giving each distinct one a dense ID.
+class string_pool {
+public:
+  unsigned intern(const string& s);
+  const string& get(unsigned id) const;
+  unsigned size() const;
+private:
+  vector<string> strings;
+  unordered_map<string, unsigned> ids;
+};
+
+// A Derivation stored as interned translation and suffix IDs.
+// Only the non-NULL pieces are kept, in permutation order, along with
+// the source word each one translates; every other source word
+// translates to NULL with an empty suffix. Strings are only rebuilt,
+// from the pool the derivation was interned into, on output. At most
+// max_pieces pieces fit, so callers must skip longer derivations.
+class CompactDerivation {
+public:
+  static const unsigned max_pieces = 5;
+  CompactDerivation();
+  CompactDerivation(const Derivation& derivation, string_pool& pool);
+  Derivation expand(const string_pool& pool) const;
+  string toString(const string_pool& pool) const;
+
+  unsigned size() const;
+  unsigned word(unsigned i) const;
+  unsigned translation(unsigned i) const;
+  unsigned suffix(unsigned i) const;
+
+  bool operator==(const CompactDerivation& other) const;
+  bool operator<(const CompactDerivation& other) const;
+  size_t hash() const;
+
+private:
+  uint32_t translations[max_pieces];
+  uint32_t suffixes[max_pieces];
+  uint8_t words[max_pieces];
+  uint8_t num_words;
+  uint8_t num_pieces;
+};
+
+namespace std {
+  template<>
+  struct hash<CompactDerivation> {
+    size_t operator()(const CompactDerivation& d) const {
+      return d.hash();
+    }
+  };
+}
@@ -0,0 +1,225 @@
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <type_traits>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "derivation_cache.h"
+using namespace std;
+
+static_assert(is_trivially_copyable<CompactDerivation>::value,
+  "CompactDerivation must be trivially copyable to be cached");
+
+const uint32_t derivation_cache::version;
+
+static const char cache_magic[8] = {'C', 'R', 'F', 'D', 'E', 'R', 'I', 'V'};
+
+// Everything after the header is a sequence of packed arrays, in the order
+// the fields below give their lengths. All of them are multiples of four
+// bytes except the string data, which comes last.
+struct derivation_cache::header {
+  char magic[8];
+  uint32_t version;
+  uint32_t derivation_size;
+  uint64_t key;
+  uint32_t num_instances;
+  uint32_t num_derivations;
+  uint32_t num_strings;
+  uint32_t num_suffixes;
+  uint64_t string_bytes;
+};
+
+static uint64_t fnv_file(const string& filename, uint64_t h) {
+  ifstream f(filename, ios::binary);
+  if (!f.is_open()) {
+    cerr << "ERROR: Unable to open " << filename << "." << endl;
+    exit(1);
+  }
+  char buffer[1 << 16];
+  while (f) {
+    f.read(buffer, sizeof(buffer));
+    const streamsize n = f.gcount();
+    for (streamsize i = 0; i < n; ++i) {
+      h = (h ^ (unsigned char)buffer[i]) * 0x100000001b3ULL;
+    }
+  }
+  return h;
+}
+
+uint64_t derivation_cache::key(const string& train_filename, const string& ttable_filename,
+    uint64_t analyzer) {
+  uint64_t h = 0xcbf29ce484222325ULL ^ version;
+  for (unsigned i = 0; i < 8; ++i) {
+    h = (h ^ ((analyzer >> (8 * i)) & 0xff)) * 0x100000001b3ULL;
+  }
+  h = fnv_file(train_filename, h);
+  h = fnv_file(ttable_filename, h);
+  return h;
+}
+
+template<typename T>
+static void write_array(ofstream& f, const T* p, size_t n) {
+  f.write(reinterpret_cast<const char*>(p), n * sizeof(T));
+}
+
+// Writes to a temporary file first, so that an interrupted run never
+// leaves a truncated cache behind.
+void derivation_cache::write(const string& filename, uint64_t key,
+    const vector<unsigned>& instances,
+    const vector<vector<CompactDerivation> >& derivations,
+    const string_pool& pool, const vector<unsigned>& suffixes) {
+  assert (instances.size() == derivations.size());
+
+  vector<uint32_t> offsets(1, 0);
+  for (const vector<CompactDerivation>& d : derivations) {
+    offsets.push_back(offsets.back() + d.size());
+  }
+  vector<uint32_t> string_offsets(1, 0);
+  for (unsigned i = 0; i < pool.size(); ++i) {
+    string_offsets.push_back(string_offsets.back() + pool.get(i).size());
+  }
+
+  header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, cache_magic, sizeof(h.magic));
+  h.version = version;
+  h.derivation_size = sizeof(CompactDerivation);
+  h.key = key;
+  h.num_instances = instances.size();
+  h.num_derivations = offsets.back();
+  h.num_strings = pool.size();
+  h.num_suffixes = suffixes.size();
+  h.string_bytes = string_offsets.back();
+
+  const string temp_filename = filename + ".tmp";
+  ofstream f(temp_filename, ios::binary);
+  if (!f.is_open()) {
+    cerr << "Unable to write derivation cache " << filename << "." << endl;
+    return;
+  }
+  write_array(f, &h, 1);
+  vector<uint32_t> ids(instances.begin(), instances.end());
+  write_array(f, ids.data(), ids.size());
+  write_array(f, offsets.data(), offsets.size());
+  for (const vector<CompactDerivation>& d : derivations) {
+    write_array(f, d.data(), d.size());
+  }
+  write_array(f, string_offsets.data(), string_offsets.size());
+  ids.assign(suffixes.begin(), suffixes.end());
+  write_array(f, ids.data(), ids.size());
+  for (unsigned i = 0; i < pool.size(); ++i) {
+    write_array(f, pool.get(i).data(), pool.get(i).size());
+  }
+  f.close();
+  if (!f || rename(temp_filename.c_str(), filename.c_str()) != 0) {
+    cerr << "Unable to write derivation cache " << filename << "." << endl;
+    remove(temp_filename.c_str());
+  }
+}
+
+derivation_cache::derivation_cache() : data(NULL), length(0), head(NULL) {}
+
+derivation_cache::~derivation_cache() {
+  close();
+}
+
+void derivation_cache::close() {
+  if (data != NULL) {
+    munmap(data, length);
+  }
+  data = NULL;
+  length = 0;
+  head = NULL;
+}
+
+bool derivation_cache::open(const string& filename, uint64_t key) {
+  close();
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(header)) {
+    ::close(fd);
+    return false;
+  }
+  length = st.st_size;
+  data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    data = NULL;
+    length = 0;
+    return false;
+  }
+
+  head = reinterpret_cast<const header*>(data);
+  if (memcmp(head->magic, cache_magic, sizeof(cache_magic)) != 0 ||
+      head->version != version ||
+      head->derivation_size != sizeof(CompactDerivation) ||
+      head->key != key) {
+    close();
+    return false;
+  }
+
+  const size_t expected = sizeof(header) +
+    sizeof(uint32_t) * (head->num_instances + head->num_instances + 1) +
+    sizeof(CompactDerivation) * (size_t)head->num_derivations +
+    sizeof(uint32_t) * (head->num_strings + 1 + head->num_suffixes) +
+    head->string_bytes;
+  if (length != expected) {
+    close();
+    return false;
+  }
+
+  const char* p = reinterpret_cast<const char*>(data) + sizeof(header);
+  instances = reinterpret_cast<const uint32_t*>(p);
+  p += sizeof(uint32_t) * head->num_instances;
+  offsets = reinterpret_cast<const uint32_t*>(p);
+  p += sizeof(uint32_t) * (head->num_instances + 1);
+  derivations = reinterpret_cast<const CompactDerivation*>(p);
+  p += sizeof(CompactDerivation) * head->num_derivations;
+  string_offsets = reinterpret_cast<const uint32_t*>(p);
+  p += sizeof(uint32_t) * (head->num_strings + 1);
+  suffix_ids = reinterpret_cast<const uint32_t*>(p);
+  p += sizeof(uint32_t) * head->num_suffixes;
+  strings = p;
+  return true;
+}
+
+unsigned derivation_cache::size() const {
+  return head == NULL ? 0 : head->num_instances;
+}
+
+unsigned derivation_cache::instance(unsigned i) const {
+  assert (i < size());
+  return instances[i];
+}
+
+const CompactDerivation* derivation_cache::begin(unsigned i) const {
+  assert (i < size());
+  return derivations + offsets[i];
+}
+
+const CompactDerivation* derivation_cache::end(unsigned i) const {
+  assert (i < size());
+  return derivations + offsets[i + 1];
+}
+
+void derivation_cache::load_pool(string_pool& pool) const {
+  assert (head != NULL);
+  assert (pool.size() == 0);
+  for (unsigned i = 0; i < head->num_strings; ++i) {
+    const string s(strings + string_offsets[i], strings + string_offsets[i + 1]);
+    const unsigned id = pool.intern(s);
+    assert (id == i);
+  }
+}
+
+vector<unsigned> derivation_cache::suffixes() const {
+  assert (head != NULL);
+  return vector<unsigned>(suffix_ids, suffix_ids + head->num_suffixes);
+}
@@ -0,0 +1,57 @@
+#pragma once
+#include <cstdint>
+#include <string>
+#include <vector>
+#include "derivation.h"
+using namespace std;
+
+// A binary on-disk copy of the analyzed training corpus: the reachable
+// instances (as line numbers into the training file), their compact
+// derivations, the string pool those refer to, and the suffix inventory
+// used to preload features. The file is keyed by a hash of the training
+// file, the ttable the analyzer used and the analyzer's fingerprint, and
+// is memory-mapped on load, so a stale or foreign cache is simply ignored
+// and rebuilt.
+class derivation_cache {
+public:
+  static const uint32_t version = 1;
+
+  derivation_cache();
+  ~derivation_cache();
+
+  static uint64_t key(const string& train_filename, const string& ttable_filename,
+    uint64_t analyzer);
+  static void write(const string& filename, uint64_t key,
+    const vector<unsigned>& instances,
+    const vector<vector<CompactDerivation> >& derivations,
+    const string_pool& pool, const vector<unsigned>& suffixes);
+
+  // Maps filename, returning false if it is missing, malformed, from
+  // another format version, or was built from different inputs.
+  bool open(const string& filename, uint64_t key);
+
+  unsigned size() const;
+  unsigned instance(unsigned i) const;
+  const CompactDerivation* begin(unsigned i) const;
+  const CompactDerivation* end(unsigned i) const;
+  // Interns the cached strings into an empty pool, so that the IDs
+  // stored in the derivations are valid for it.
+  void load_pool(string_pool& pool) const;
+  vector<unsigned> suffixes() const;
+
+private:
+  struct header;
+  derivation_cache(const derivation_cache&);
+  derivation_cache& operator=(const derivation_cache&);
+  void close();
+
+  void* data;
+  size_t length;
+  const header* head;
+  const uint32_t* instances;
+  const uint32_t* offsets;
+  const CompactDerivation* derivations;
+  const uint32_t* string_offsets;
+  const uint32_t* suffix_ids;
+  const char* strings;
+};
@@ -0,0 +1,124 @@
+#include <cassert>
+#include <chrono>
+#include <iomanip>
+#include <thread>
+#include "line_pipeline.h"
+using namespace std;
+
+line_pipeline::line_pipeline(unsigned num_threads, size_t batch_size, unsigned max_batches) :
+    num_threads(num_threads > 0 ? num_threads : 1), batch_size(batch_size),
+    max_batches(max_batches > 0 ? max_batches : 4 * this->num_threads), reading(false) {
+  assert (batch_size > 0);
+}
+
+void line_pipeline::read(istream& in) {
+  size_t line_number = 1;
+  while (true) {
+    shared_ptr<batch> b(new batch());
+    b->first_line = line_number;
+    b->ready = false;
+    b->lines.reserve(batch_size);
+    string line;
+    while (b->lines.size() < batch_size && getline(in, line)) {
+      b->lines.push_back(line);
+    }
+    b->size = b->lines.size();
+    line_number += b->size;
+
+    unique_lock<mutex> lock(m);
+    if (!b->lines.empty()) {
+      space.wait(lock, [this] { return in_flight.size() < max_batches; });
+      in_flight.push_back(b);
+      pending.push_back(b);
+      pending_work.notify_one();
+    }
+    if (b->lines.size() < batch_size) {
+      reading = false;
+      pending_work.notify_all();
+      finished.notify_one();
+      return;
+    }
+  }
+}
+
+void line_pipeline::work(unsigned worker, const processor& process) {
+  while (true) {
+    shared_ptr<batch> b;
+    {
+      unique_lock<mutex> lock(m);
+      pending_work.wait(lock, [this] { return !pending.empty() || !reading; });
+      if (pending.empty()) {
+        return;
+      }
+      b = pending.front();
+      pending.pop_front();
+    }
+
+    for (size_t i = 0; i < b->lines.size(); ++i) {
+      process(worker, b->first_line + i, b->lines[i], b->output);
+    }
+    b->lines.clear();
+
+    lock_guard<mutex> lock(m);
+    b->ready = true;
+    finished.notify_one();
+  }
+}
+
+void line_pipeline::run(istream& in, ostream& out, const processor& process) {
+  typedef chrono::steady_clock clock;
+  const clock::time_point start = clock::now();
+  clock::time_point last_report = start;
+  lines = 0;
+  bytes_written = 0;
+  reading = true;
+
+  thread reader(&line_pipeline::read, this, ref(in));
+  vector<thread> workers;
+  for (unsigned i = 0; i < num_threads; ++i) {
+    workers.push_back(thread(&line_pipeline::work, this, i, cref(process)));
+  }
+
+  while (true) {
+    shared_ptr<batch> b;
+    {
+      unique_lock<mutex> lock(m);
+      finished.wait(lock, [this] {
+        return (!in_flight.empty() && in_flight.front()->ready) || (in_flight.empty() && !reading);
+      });
+      if (in_flight.empty()) {
+        break;
+      }
+      b = in_flight.front();
+      in_flight.pop_front();
+      space.notify_one();
+    }
+
+    out.write(b->output.data(), b->output.size());
+    lines += b->size;
+    bytes_written += b->output.size();
+
+    const clock::time_point now = clock::now();
+    if (progress && now - last_report >= chrono::seconds(1)) {
+      const double elapsed = chrono::duration<double>(now - start).count();
+      const streamsize precision = cerr.precision();
+      cerr << "\r" << lines << " lines, " << fixed << setprecision(0) << lines / elapsed
+           << " lines/s, " << setprecision(1) << bytes_written / 1.0e6 << " MB written";
+      cerr.unsetf(ios::floatfield);
+      cerr.precision(precision);
+      last_report = now;
+    }
+  }
+  out.flush();
+
+  reader.join();
+  for (thread& worker : workers) {
+    worker.join();
+  }
+
+  seconds = chrono::duration<double>(clock::now() - start).count();
+  if (progress) {
+    cerr << "\r" << lines << " lines in " << seconds << " seconds ("
+         << (seconds > 0.0 ? lines / seconds : 0.0) << " lines/s)" << endl;
+  }
+}
@@ -0,0 +1,65 @@
+#pragma once
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <vector>
+using std::condition_variable;
+using std::deque;
+using std::function;
+using std::istream;
+using std::mutex;
+using std::ostream;
+using std::shared_ptr;
+using std::string;
+using std::vector;
+
+// Streams the lines of an input through a pool of workers to an output,
+// in input order. A reader thread cuts the input into batches of
+// batch_size lines, workers turn each batch into one block of output text,
+// and the calling thread writes finished blocks in order with one large
+// write each. At most max_batches batches are read but not yet written,
+// so memory stays bounded however far the reader could run ahead.
+class line_pipeline {
+public:
+  // Appends the output for one line (possibly nothing) to output.
+  // worker identifies the calling thread, in [0, num_threads), for
+  // callers that keep per-thread state. line_number counts from 1.
+  typedef function<void(unsigned worker, size_t line_number, const string& line, string& output)> processor;
+
+  line_pipeline(unsigned num_threads, size_t batch_size = 1024, unsigned max_batches = 0);
+  void run(istream& in, ostream& out, const processor& process);
+
+  // Whether to print a throughput report on stderr about once a second
+  bool progress = true;
+  // Totals from the last run()
+  size_t lines = 0;
+  size_t bytes_written = 0;
+  double seconds = 0.0;
+
+private:
+  struct batch {
+    size_t first_line;
+    size_t size;
+    vector<string> lines;
+    string output;
+    bool ready;
+  };
+  void read(istream& in);
+  void work(unsigned worker, const processor& process);
+
+  unsigned num_threads;
+  size_t batch_size;
+  unsigned max_batches;
+
+  mutex m;
+  condition_variable space;
+  condition_variable pending_work;
+  condition_variable finished;
+  deque<shared_ptr<batch> > in_flight;
+  deque<shared_ptr<batch> > pending;
+  bool reading;
+};
@@ -5,8 +5,14 @@
 #include <vector>
 #include <map>
 #include <cassert>
+#include <cstdio>
 #include <fstream>
 #include <sstream>
+#include <algorithm>
+#include <memory>
+#include <random>
+#include <chrono>
+#include <limits>
 
 #include <execinfo.h>
 #include <signal.h>
@@ -17,8 +23,12 @@
 
 #include "adept.h"
 #include "crf.h"
+#include "checkpoint.h"
 #include "feature_scorer.h"
 #include "compound_analyzer.h"
+#include "derivation_cache.h"
+#include "thread_pool.h"
+#include "optimizer.h"
 #include "noise_model.h"
 
 using namespace std;
@@ -27,6 +37,41 @@ using adept::adouble;
 const double eta = 0.01;
 const double lambda = 0.0;
 const int num_noise_samples = 100;
+const uint64_t noise_seed = 0;
+const unsigned num_threads = thread::hardware_concurrency();
+// Threads that score each lattice step's LM transitions in online training
+// (see crf::lattice_threads). Batch training runs whole examples on
+// num_threads instead.
+const unsigned lattice_threads = 1;
+const unsigned num_iterations = 0;
+const unsigned checkpoint_interval = 1000;
+const char* checkpoint_filename = "model.checkpoint";
+// Visit the training examples in a new random order every epoch instead
+// of in corpus order
+const bool shuffle_examples = false;
+// Train in batch with L-BFGS, or OWL-QN if l1_strength > 0, instead of
+// with online AdaDelta
+const bool use_lbfgs = false;
+const unsigned lbfgs_memory = 10;
+// The L1 penalty. Online training applies it with proximal updates, and
+// together with lambda it gives the elastic net.
+const double l1_strength = 0.0;
+// Before the model is written, drop features with weights no bigger than
+// compact_threshold and suffixes more than suffix_margin below the best
+// one (see crf::compact). This can change the model's output, so it is
+// off by default.
+const bool compact_model = false;
+const double compact_threshold = 0.0;
+const double suffix_margin = 20.0;
+// Approximate the lattice's partition function during training by keeping
+// at most beam_size states per step (0 = no limit) and dropping states more
+// than beam_threshold below the best (see crf::beam_size)
+const unsigned beam_size = 0;
+const double beam_threshold = numeric_limits<double>::infinity();
+// Only let roots take the suffixes seen after roots with the same ending
+// (up to suffix_ending_length characters) in the training derivations
+const bool use_suffix_index = true;
+const unsigned suffix_ending_length = 3;
 
 void read_input_file(string filename, vector<vector<string> >& X, vector<string>& Y) {
   ifstream f(filename);
@@ -53,6 +98,30 @@ void read_input_file(string filename, vector<vector<string> >& X, vector<string>
   }
 }
 
+// Checks that every derivation of a training example spells out its target.
+// Like the asserts, it is compiled out when NDEBUG is defined. The Makefile
+// does not define it, so this normally runs, but only when the corpus is
+// analyzed rather than loaded from the derivation cache.
+void check_derivations(const vector<string>& source, const string& target, const vector<Derivation>& derivations) {
+#ifndef NDEBUG
+  for (const Derivation& d : derivations) {
+    if (d.toString() != target) {
+      stringstream ss;
+      ss << "source: ";
+      for (unsigned j = 0; j < source.size(); ++j) {
+        ss << source[j] << " ";
+      }
+      ss << endl;
+      ss << d.toLongString() << endl;
+      ss << "derivation: " << d.toString() << endl;
+      ss << "target: " << target << endl;
+      cerr << ss.str();
+    }
+    assert (d.toString() == target);
+  }
+#endif
+}
+
 Derivation sample_derivation(crf* model, const vector<string>& input, const vector<Derivation>& derivations) {
   vector<adouble> scores(derivations.size(), 0.0);
   adouble sum = 0.0;
@@ -122,8 +191,8 @@ void test(int argc, char** argv) {
   model.add_feature("suffix_");
   model.add_feature("tomato_to_null");
   model.add_feature("processing_to_null");
-  model.suffix_list.insert("");
-  model.suffix_list.insert("n");
+  model.add_suffix("");
+  model.add_suffix("n");
 
   vector<string> input {"tomato", "processing"}; 
 
@@ -139,6 +208,20 @@ void test(int argc, char** argv) {
   assert (diff < 1.0e-6);
 }
 
+// A checkpoint only resumes the run that wrote it: one on the same
+// derivations (cache_key, see derivation_cache::key) with the same
+// training settings.
+uint64_t checkpoint_key(uint64_t cache_key) {
+  const double settings[] = {eta, lambda, l1_strength, (double)use_lbfgs, (double)shuffle_examples,
+    (double)use_suffix_index, (double)suffix_ending_length, (double)beam_size, beam_threshold};
+  const unsigned char* p = reinterpret_cast<const unsigned char*>(settings);
+  uint64_t h = cache_key;
+  for (size_t i = 0; i < sizeof(settings); ++i) {
+    h = (h ^ p[i]) * 0x100000001b3ULL;
+  }
+  return h;
+}
+
 int main(int argc, char** argv) {
   signal(SIGSEGV, exception_handler);
   if (argc != 6) {
@@ -153,7 +236,8 @@ int main(int argc, char** argv) {
   // read training data
   vector<vector<string> > train_source;
   vector<string> train_target;
-  vector<vector<Derivation> > train_derivations;
+  vector<vector<CompactDerivation> > train_derivations;
+  string_pool pieces;
   read_input_file(argv[1], train_source, train_target);
 
   cerr << "Successfully read " << train_source.size() << " training instances." << endl;
@@ -172,49 +256,130 @@ int main(int argc, char** argv) {
   NeuralLM lm = NeuralLM::ReadFromFile(argv[5]);
 
   feature_scorer scorer(&fwd_ttable, &rev_ttable);
-  compound_analyzer analyzer(&fwd_ttable);
 
   scorer.lm_vocab = &lm_vocab;
   scorer.lm = &lm;
 
-  // Analyze the target side of the training corpus into lists of possible derivations
-  cerr << "Analyzing training data..." << endl;
-  for (unsigned i = 0; i < train_source.size(); ++i) {
-    cerr << i << "/" << train_source.size() << "\r";
-    vector<Derivation> derivations = analyzer.analyze(train_source[i], train_target[i]);
-    for (Derivation& d : derivations) {
-      if (d.toString() != train_target[i]) {
-        cerr << "source: ";
-        for (unsigned j = 0; j < train_source[i].size(); ++j) {
-          cerr << train_source[i][j] << " ";
+  // Analyzing the corpus depends only on the training file, the forward
+  // ttable and the analyzer, so its result is cached next to the training file.
+  const string cache_filename = string(argv[1]) + ".derivations";
+  const uint64_t cache_key = derivation_cache::key(argv[1], argv[2], compound_analyzer::fingerprint());
+  derivation_cache cache;
+  set<unsigned> suffix_ids;
+  if (cache.open(cache_filename, cache_key)) {
+    cerr << "Loading analyzed training data from " << cache_filename << "..." << endl;
+    cache.load_pool(pieces);
+    vector<vector<string> > reachable_source;
+    vector<string> reachable_target;
+    for (unsigned i = 0; i < cache.size(); ++i) {
+      const unsigned n = cache.instance(i);
+      assert (n < train_source.size());
+      reachable_source.push_back(train_source[n]);
+      reachable_target.push_back(train_target[n]);
+      train_derivations.push_back(vector<CompactDerivation>(cache.begin(i), cache.end(i)));
+    }
+    train_source.swap(reachable_source);
+    train_target.swap(reachable_target);
+    vector<unsigned> cached_suffixes = cache.suffixes();
+    suffix_ids.insert(cached_suffixes.begin(), cached_suffixes.end());
+  }
+  else {
+    compound_analyzer analyzer(&fwd_ttable);
+    thread_pool pool(num_threads);
+
+    // Analyze the target side of the training corpus into lists of possible derivations
+    cerr << "Analyzing training data on " << pool.size() << " threads..." << endl;
+    vector<vector<Derivation> > analyses(train_source.size());
+    // Lines with more English words than the analyzer takes are left
+    // without derivations, so they are removed with the unreachable ones
+    pool.run(train_source.size(), [&](size_t i) {
+      if (train_source[i].size() > compound_analyzer::max_words) {
+        return;
+      }
+      analyses[i] = analyzer.analyze(train_source[i], train_target[i]);
+      check_derivations(train_source[i], train_target[i], analyses[i]);
+    });
+
+    // Interning happens in corpus order, so string IDs do not depend on
+    // how the analyses were scheduled. Compounds with a derivation of more
+    // pieces than CompactDerivation can hold are left without derivations,
+    // so they are removed with the unreachable ones below.
+    vector<unsigned> train_ids;
+    unsigned too_long = 0;
+    for (unsigned i = 0; i < analyses.size(); ++i) {
+      vector<CompactDerivation> compact;
+      bool fits = true;
+      for (const Derivation& d : analyses[i]) {
+        if (d.permutation.size() > CompactDerivation::max_pieces) {
+          fits = false;
         }
-        cerr << endl;
-        cerr << d.toLongString() << endl;
-        cerr << "derivation: " << d.toString() << endl;
-        cerr << "target: " << train_target[i] << endl;
       }
-      assert (d.toString() == train_target[i]);
+      if (!fits) {
+        too_long++;
+        train_derivations.push_back(compact);
+        train_ids.push_back(i);
+        continue;
+      }
+      compact.reserve(analyses[i].size());
+      for (const Derivation& d : analyses[i]) {
+        compact.push_back(CompactDerivation(d, pieces));
+      }
+      train_derivations.push_back(compact);
+      train_ids.push_back(i);
+    }
+    analyses.clear();
+    unsigned too_many_words = 0;
+    for (const vector<string>& source : train_source) {
+      if (source.size() > compound_analyzer::max_words) {
+        too_many_words++;
+      }
+    }
+    if (too_many_words > 0) {
+      cerr << "Skipping " << too_many_words << " compounds with more than " << compound_analyzer::max_words
+           << " English words." << endl;
+    }
+    if (too_long > 0) {
+      cerr << "Skipping " << too_long << " compounds with derivations of more than "
+           << CompactDerivation::max_pieces << " pieces." << endl;
     }
-    train_derivations.push_back(derivations);
-  }
-  cerr << train_source.size() << "/" << train_source.size() << "\n";
 
-  cerr << "Removing unreachable compounds..." << endl;
-  // Remove any unreachable references from the training data
-  for (unsigned i = 0; i < train_source.size(); ++i) {
-    cerr << i << "/" << train_source.size() << "\r";
-    if (train_derivations[i].size() == 0) { 
-      train_source.erase(train_source.begin() + i);
-      train_target.erase(train_target.begin() + i); 
-      train_derivations.erase(train_derivations.begin() + i);
-      i--;
+    cerr << "Removing unreachable compounds..." << endl;
+    // Remove any unreachable references from the training data, keeping
+    // the remaining examples in their original order
+    unsigned kept = 0;
+    for (unsigned i = 0; i < train_source.size(); ++i) {
+      if (train_derivations[i].size() == 0) {
+        continue;
+      }
+      if (kept != i) {
+        train_source[kept].swap(train_source[i]);
+        train_target[kept].swap(train_target[i]);
+        train_derivations[kept].swap(train_derivations[i]);
+        train_ids[kept] = train_ids[i];
+      }
+      ++kept;
+    }
+    train_source.resize(kept);
+    train_target.resize(kept);
+    train_derivations.resize(kept);
+    train_ids.resize(kept);
+
+    for (const vector<CompactDerivation>& derivations : train_derivations) {
+      for (const CompactDerivation& derivation : derivations) {
+        for (unsigned k = 0; k < derivation.size(); ++k) {
+          suffix_ids.insert(derivation.suffix(k));
+        }
+      }
     }
+
+    cerr << "Writing analyzed training data to " << cache_filename << "..." << endl;
+    derivation_cache::write(cache_filename, cache_key, train_ids, train_derivations, pieces,
+      vector<unsigned>(suffix_ids.begin(), suffix_ids.end()));
   }
-  cerr << train_source.size() << "/" << train_source.size() << "\n";
  
   cerr << "Initializing model..." << endl;
   crf model(&stack, &scorer);
-  //noise_model noise_generator(&fwd_ttable);
+  //noise_model noise_generator(&fwd_ttable, train_source);
 
   // Preload features into the CRF to avoid adept errors
   cerr << "Preloading features..." << endl;
@@ -231,24 +396,32 @@ int main(int argc, char** argv) {
     for (unsigned j = 0; j < train_source[i].size(); ++j) {
       model.add_feature(train_source[i][j] + "_to_null");
     }
-    for (Derivation& derivation : train_derivations[i]) {
-      for (string suffix : derivation.suffixes) {
-        model.suffix_list.insert(suffix);
-        model.add_feature("suffix_" + suffix);
+  }
+  cerr << train_source.size() << "/" << train_source.size() << "\n";
+  // NULL words always take the empty suffix, even if no piece does
+  model.add_suffix("");
+  model.add_feature("suffix_");
+  for (unsigned id : suffix_ids) {
+    const string& suffix = pieces.get(id);
+    model.add_suffix(suffix);
+    model.add_feature("suffix_" + suffix);
+  }
+  if (use_suffix_index) {
+    model.root_suffixes = suffix_index(suffix_ending_length);
+    for (const vector<CompactDerivation>& derivations : train_derivations) {
+      for (const CompactDerivation& d : derivations) {
+        for (unsigned i = 0; i < d.size(); ++i) {
+          model.root_suffixes.add(pieces.get(d.translation(i)), pieces.get(d.suffix(i)));
+        }
       }
     }
+    cerr << "Indexed " << model.root_suffixes.entries().size() << " (root ending, suffix) pairs for "
+         << model.suffix_list.size() << " suffixes." << endl;
   }
-  cerr << train_source.size() << "/" << train_source.size() << "\n";
 
   /*vector<vector<Derivation> > noise_samples; 
-  for (int i = 0; i < train_source.size(); ++i) {
-    vector<Derivation> samples;
-    for (int j = 0; j < num_noise_samples; ++j) {
-      Derivation sample = noise_generator.sample(train_source[i]);
-      samples.push_back(sample);
-    }
-    noise_samples.push_back(samples);
-  }*/
+  thread_pool noise_threads(num_threads);
+  noise_generator.sample(train_source, num_noise_samples, noise_seed, noise_threads, noise_samples);*/
 
   assert (train_source.size() == train_target.size());
   assert (train_source.size() == train_derivations.size());
@@ -280,15 +453,108 @@ int main(int argc, char** argv) {
   loss += model.l2penalty(lambda);
   cerr << "Iteration " << 0 << " loss: " << loss << endl;*/
 
+  // Resume from the last checkpoint, if there is one
+  const uint64_t run_key = checkpoint_key(cache_key);
+  mt19937 rng(0);
+  unsigned first_iter = 0;
+  unsigned first_example = 0;
+  double first_loss = 0.0;
+  training_state resume;
+  if (read_checkpoint(checkpoint_filename, resume)) {
+    if (resume.key != run_key || resume.num_examples != train_source.size()) {
+      cerr << "ERROR: " << checkpoint_filename << " was written by a run with different training data or settings."
+           << " Remove it to start training over." << endl;
+      exit(1);
+    }
+    model.restore_state(resume);
+    stringstream(resume.rng) >> rng;
+    first_iter = resume.epoch;
+    first_example = resume.example;
+    first_loss = resume.epoch_loss;
+    cerr << "Resuming from " << checkpoint_filename << " at iteration " << first_iter + 1
+         << ", example " << first_example << "." << endl;
+  }
+  unique_ptr<checkpointer> checkpoints(new checkpointer(checkpoint_filename));
+
   cerr << "Training..." << endl;
-  for (unsigned iter = 0; iter < 0; ++iter) {
+  model.l1_strength = use_lbfgs ? 0.0 : l1_strength;
+  model.beam_size = beam_size;
+  model.beam_threshold = beam_threshold;
+  model.lattice_threads = lattice_threads;
+  if (use_lbfgs) {
+    thread_pool threads(num_threads);
+    lbfgs optimizer(lbfgs_memory, l1_strength);
+    vector<double> w;
+    model.get_weights(w);
+    objective_function f = [&](const vector<double>& w, vector<double>& gradient) {
+      model.set_weights(w);
+      return model.objective(train_source, train_derivations, pieces, lambda, threads, gradient);
+    };
+    for (unsigned iter = 0; iter < num_iterations && !optimizer.converged(); ++iter) {
+      const chrono::steady_clock::time_point start = chrono::steady_clock::now();
+      loss = optimizer.iterate(f, w);
+      const double seconds = chrono::duration<double>(chrono::steady_clock::now() - start).count();
+      cerr << "Iteration " << iter + 1 << " loss: " << loss << " gradient norm: " << optimizer.gradient_norm()
+           << " time: " << seconds << " s (" << optimizer.evaluations() << " evaluations so far)" << endl;
+    }
+    model.set_weights(w);
+  }
+  vector<Derivation> expanded;
+  for (unsigned iter = first_iter; iter < num_iterations && !use_lbfgs; ++iter) {
     //loss = model.train(train_source, chosen_derivations, noise_samples, eta, lambda);
     //loss = model.train(train_source, chosen_derivations, eta, lambda);
     //loss = model.train(train_source, train_derivations, eta, lambda);
-    loss = model.train_nobatch(train_source, train_derivations, eta, lambda);
+    // The example order is drawn at the start of each epoch, and the RNG
+    // state it was drawn from goes into every checkpoint of the epoch.
+    stringstream epoch_rng;
+    epoch_rng << rng;
+    vector<unsigned> order(train_source.size());
+    for (unsigned i = 0; i < order.size(); ++i) {
+      order[i] = i;
+    }
+    if (shuffle_examples) {
+      shuffle(order.begin(), order.end(), rng);
+    }
+
+    // A resumed epoch carries on from the loss checkpointed with it, so the
+    // reported loss still covers the whole epoch
+    double epoch_loss = (iter == first_iter) ? first_loss : 0.0;
+    for (unsigned i = (iter == first_iter) ? first_example : 0; i < order.size(); ++i) {
+      cerr << i << "/" << order.size() << "\r";
+      const unsigned j = order[i];
+      expanded.clear();
+      for (const CompactDerivation& d : train_derivations[j]) {
+        expanded.push_back(d.expand(pieces));
+      }
+      epoch_loss += model.train_example(train_source[j], expanded, eta, lambda).value();
+
+      const bool end_of_epoch = (i + 1 == order.size());
+      if ((i + 1) % checkpoint_interval == 0 || end_of_epoch) {
+        unique_ptr<training_state> state(new training_state());
+        model.save_state(*state);
+        state->key = run_key;
+        state->num_examples = order.size();
+        if (end_of_epoch) {
+          stringstream next_rng;
+          next_rng << rng;
+          state->epoch = iter + 1;
+          state->example = 0;
+          state->rng = next_rng.str();
+        }
+        else {
+          state->epoch = iter;
+          state->example = i + 1;
+          state->epoch_loss = epoch_loss;
+          state->rng = epoch_rng.str();
+        }
+        checkpoints->save(move(state));
+      }
+    }
+    loss = epoch_loss;
     cerr << "Iteration " << iter + 1 << " loss: " << loss << endl;
     cerr.flush();
   }
+  model.catch_up();
 
   cerr << "Final loss: " << loss << endl;
   cerr << "Final weights: " << endl;
@@ -298,8 +564,19 @@ int main(int argc, char** argv) {
     }
   }
   cerr.flush();
+  if (compact_model) {
+    const size_t num_features = model.weights.size();
+    const size_t num_suffixes = model.suffix_list.size();
+    model.compact(compact_threshold, suffix_margin);
+    cerr << "Compacted the model from " << num_features << " features and " << num_suffixes << " suffixes to "
+         << model.weights.size() << " and " << model.suffix_list.size() << "." << endl;
+  }
   cerr << "Dumping model..." << endl;
   model.WriteToFile("model.crf");
+  // Training is done, so the checkpoint is no longer needed. The
+  // checkpointer is destroyed first so nothing is written after it's gone.
+  checkpoints.reset();
+  remove(checkpoint_filename);
 
   for (unsigned j = 0; j < train_source.size(); ++j) {
     vector<string>& input = train_source[j];
@@ -311,7 +588,8 @@ int main(int argc, char** argv) {
     cout << "||| " << train_target[j];
     cout << " ||| partition function: " << z << endl;
 
-    for (Derivation& gold : train_derivations[j]) {
+    for (const CompactDerivation& compact : train_derivations[j]) {
+      Derivation gold = compact.expand(pieces);
       map<string, double> features = scorer.score(input, gold);
       double score = model.dot(features, model.weights).value();
       cout << j << " ||| G ||| " << gold.toLongString(features) << "||| " << score << endl;
@@ -0,0 +1,256 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <vector>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "model_file.h"
+using namespace std;
+
+const uint32_t model_file::version;
+const unsigned model_file::none;
+
+static const char model_magic[8] = {'C', 'R', 'F', 'M', 'O', 'D', 'E', 'L'};
+static const uint32_t compacted_flag = 1;
+
+// The header is followed by the weights, the name and suffix offset
+// tables, and then the name and suffix bytes. It is a multiple of eight
+// bytes long, so the weights are aligned.
+struct model_file::header {
+  char magic[8];
+  uint32_t version;
+  uint32_t num_features;
+  uint32_t num_suffixes;
+  uint32_t flags;
+  uint64_t name_bytes;
+  uint64_t suffix_bytes;
+};
+
+static uint32_t read_uint32(const char* p, size_t i) {
+  uint32_t v;
+  memcpy(&v, p + i * sizeof(uint32_t), sizeof(v));
+  return v;
+}
+
+bool model_file::is_binary(const string& filename) {
+  ifstream f(filename, ios::binary);
+  char magic[sizeof(model_magic)];
+  return f.read(magic, sizeof(magic)) && memcmp(magic, model_magic, sizeof(magic)) == 0;
+}
+
+// Writes to a temporary file and renames it into place, so an interrupted
+// run never leaves a truncated model, and processes that have the old file
+// mapped keep reading it unchanged.
+void model_file::write(const string& filename, const map<string, adouble>& weights,
+    const unordered_set<string>& suffix_set, const suffix_index& index, bool compacted) {
+  vector<string> suffixes(suffix_set.begin(), suffix_set.end());
+  sort(suffixes.begin(), suffixes.end());
+
+  vector<double> values;
+  vector<uint32_t> name_offsets(1, 0);
+  values.reserve(weights.size());
+  name_offsets.reserve(weights.size() + 1);
+  for (auto& kvp : weights) {
+    values.push_back(kvp.second.value());
+    name_offsets.push_back(name_offsets.back() + kvp.first.size());
+  }
+  vector<uint32_t> suffix_offsets(1, 0);
+  for (const string& suffix : suffixes) {
+    suffix_offsets.push_back(suffix_offsets.back() + suffix.size());
+  }
+
+  header h;
+  memset(&h, 0, sizeof(h));
+  memcpy(h.magic, model_magic, sizeof(h.magic));
+  h.version = version;
+  h.num_features = weights.size();
+  h.num_suffixes = suffixes.size();
+  h.flags = compacted ? compacted_flag : 0;
+  h.name_bytes = name_offsets.back();
+  h.suffix_bytes = suffix_offsets.back();
+
+  const string temp_filename = filename + ".tmp";
+  ofstream f(temp_filename, ios::binary);
+  if (!f.is_open()) {
+    cerr << "ERROR: Unable to write model to " << filename << "." << endl;
+    exit(1);
+  }
+  f.write(reinterpret_cast<const char*>(&h), sizeof(h));
+  f.write(reinterpret_cast<const char*>(values.data()), values.size() * sizeof(double));
+  f.write(reinterpret_cast<const char*>(name_offsets.data()), name_offsets.size() * sizeof(uint32_t));
+  f.write(reinterpret_cast<const char*>(suffix_offsets.data()), suffix_offsets.size() * sizeof(uint32_t));
+  for (auto& kvp : weights) {
+    f.write(kvp.first.data(), kvp.first.size());
+  }
+  for (const string& suffix : suffixes) {
+    f.write(suffix.data(), suffix.size());
+  }
+
+  const vector<pair<string, string> > entries = index.entries();
+  vector<uint32_t> index_header;
+  index_header.push_back(entries.size());
+  index_header.push_back(index.max_ending());
+  index_header.push_back(0);
+  for (auto& entry : entries) {
+    index_header.push_back(index_header.back() + entry.first.size());
+    index_header.push_back(index_header.back() + entry.second.size());
+  }
+  f.write(reinterpret_cast<const char*>(index_header.data()), index_header.size() * sizeof(uint32_t));
+  for (auto& entry : entries) {
+    f.write(entry.first.data(), entry.first.size());
+    f.write(entry.second.data(), entry.second.size());
+  }
+  f.close();
+  if (!f || rename(temp_filename.c_str(), filename.c_str()) != 0) {
+    cerr << "ERROR: Unable to write model to " << filename << "." << endl;
+    remove(temp_filename.c_str());
+    exit(1);
+  }
+}
+
+model_file::model_file() : data(NULL), length(0), head(NULL), index_section(NULL) {}
+
+model_file::~model_file() {
+  close();
+}
+
+void model_file::close() {
+  if (data != NULL) {
+    munmap(data, length);
+  }
+  data = NULL;
+  length = 0;
+  head = NULL;
+  index_section = NULL;
+}
+
+bool model_file::open(const string& filename) {
+  close();
+  int fd = ::open(filename.c_str(), O_RDONLY);
+  if (fd < 0) {
+    return false;
+  }
+  struct stat st;
+  if (fstat(fd, &st) != 0 || (size_t)st.st_size < sizeof(header)) {
+    ::close(fd);
+    return false;
+  }
+  length = st.st_size;
+  data = mmap(NULL, length, PROT_READ, MAP_PRIVATE, fd, 0);
+  ::close(fd);
+  if (data == MAP_FAILED) {
+    data = NULL;
+    length = 0;
+    return false;
+  }
+
+  head = reinterpret_cast<const header*>(data);
+  if (memcmp(head->magic, model_magic, sizeof(model_magic)) != 0 ||
+      (head->version != 1 && head->version != version)) {
+    close();
+    return false;
+  }
+  size_t expected = sizeof(header) + sizeof(double) * (size_t)head->num_features +
+    sizeof(uint32_t) * ((size_t)head->num_features + 1 + head->num_suffixes + 1) +
+    head->name_bytes + head->suffix_bytes;
+  if (head->version >= 2) {
+    index_section = reinterpret_cast<const char*>(data) + expected;
+    if (length < expected + 3 * sizeof(uint32_t)) {
+      close();
+      return false;
+    }
+    const uint32_t num_entries = read_uint32(index_section, 0);
+    expected += sizeof(uint32_t) * (3 + 2 * (size_t)num_entries);
+    if (length < expected) {
+      close();
+      return false;
+    }
+    expected += read_uint32(index_section, 2 + 2 * (size_t)num_entries);
+  }
+  if (length != expected) {
+    close();
+    return false;
+  }
+
+  const char* p = reinterpret_cast<const char*>(data) + sizeof(header);
+  weights = reinterpret_cast<const double*>(p);
+  p += sizeof(double) * head->num_features;
+  name_offsets = reinterpret_cast<const uint32_t*>(p);
+  p += sizeof(uint32_t) * (head->num_features + 1);
+  suffix_offsets = reinterpret_cast<const uint32_t*>(p);
+  p += sizeof(uint32_t) * (head->num_suffixes + 1);
+  names = p;
+  suffixes = p + head->name_bytes;
+  return true;
+}
+
+unsigned model_file::num_features() const {
+  return head == NULL ? 0 : head->num_features;
+}
+
+string model_file::feature(unsigned i) const {
+  assert (i < num_features());
+  return string(names + name_offsets[i], names + name_offsets[i + 1]);
+}
+
+double model_file::weight(unsigned i) const {
+  assert (i < num_features());
+  return weights[i];
+}
+
+unsigned model_file::find(const string& name) const {
+  unsigned low = 0;
+  unsigned high = num_features();
+  while (low < high) {
+    const unsigned mid = low + (high - low) / 2;
+    const char* begin = names + name_offsets[mid];
+    const size_t size = name_offsets[mid + 1] - name_offsets[mid];
+    const int c = name.compare(0, string::npos, begin, size);
+    if (c == 0) {
+      return mid;
+    }
+    if (c < 0) {
+      high = mid;
+    }
+    else {
+      low = mid + 1;
+    }
+  }
+  return none;
+}
+
+unsigned model_file::num_suffixes() const {
+  return head == NULL ? 0 : head->num_suffixes;
+}
+
+string model_file::suffix(unsigned i) const {
+  assert (i < num_suffixes());
+  return string(suffixes + suffix_offsets[i], suffixes + suffix_offsets[i + 1]);
+}
+
+bool model_file::compacted() const {
+  assert (head != NULL);
+  return (head->flags & compacted_flag) != 0;
+}
+
+suffix_index model_file::index() const {
+  assert (head != NULL);
+  if (index_section == NULL) {
+    return suffix_index();
+  }
+  const uint32_t num_entries = read_uint32(index_section, 0);
+  suffix_index r(read_uint32(index_section, 1));
+  const char* strings = index_section + sizeof(uint32_t) * (3 + 2 * (size_t)num_entries);
+  for (uint32_t i = 0; i < num_entries; ++i) {
+    const uint32_t a = read_uint32(index_section, 2 + 2 * i);
+    const uint32_t b = read_uint32(index_section, 3 + 2 * i);
+    const uint32_t c = read_uint32(index_section, 4 + 2 * i);
+    r.add_entry(string(strings + a, strings + b), string(strings + b, strings + c));
+  }
+  return r;
+}
@@ -0,0 +1,66 @@
+#pragma once
+#include <cstdint>
+#include <map>
+#include <string>
+#include <unordered_set>
+#include "adept.h"
+#include "suffix_index.h"
+using std::map;
+using std::string;
+using std::unordered_set;
+using adept::adouble;
+
+// The binary crf model format: a table of feature names, a contiguous
+// array of their weights, and the suffix list. Features are stored in
+// name order, so a mapped file can look a weight up by binary search
+// without building anything, and loading it into a std::map is a single
+// linear pass. Files are memory-mapped for reading. Version 2 adds the
+// model's suffix index at the end; version 1 files are still read.
+class model_file {
+public:
+  static const uint32_t version = 2;
+  static const unsigned none = ~0u;
+
+  model_file();
+  ~model_file();
+
+  // Whether filename starts with the binary format's magic number
+  static bool is_binary(const string& filename);
+  // compacted marks a model whose missing features have weight zero (see
+  // crf::compact)
+  static void write(const string& filename, const map<string, adouble>& weights,
+    const unordered_set<string>& suffixes, const suffix_index& index, bool compacted = false);
+
+  // Returns false if filename is missing, malformed or from another version
+  bool open(const string& filename);
+
+  unsigned num_features() const;
+  string feature(unsigned i) const;
+  double weight(unsigned i) const;
+  // The index of the named feature, or none
+  unsigned find(const string& name) const;
+  unsigned num_suffixes() const;
+  string suffix(unsigned i) const;
+  bool compacted() const;
+  // The saved suffix index, which is empty for version 1 files
+  suffix_index index() const;
+
+private:
+  struct header;
+  model_file(const model_file&);
+  model_file& operator=(const model_file&);
+  void close();
+
+  void* data;
+  size_t length;
+  const header* head;
+  const double* weights;
+  const uint32_t* name_offsets;
+  const uint32_t* suffix_offsets;
+  const char* names;
+  const char* suffixes;
+  // The index section: its entry count and max_ending, then 2n + 1
+  // offsets into its strings, which alternate between ending and suffix.
+  // It follows the suffix bytes, so it is read with memcpy.
+  const char* index_section;
+};
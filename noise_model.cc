@@ -1,47 +1,114 @@
 #include <cassert>
+#include <cmath>
 #include "noise_model.h"
 using namespace std;
 
-noise_model::noise_model(ttable* fwd_ttable) {
-  this->fwd_ttable = fwd_ttable;
+// The SplitMix64 finalizer
+static uint64_t mix(uint64_t x) {
+  x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+  x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+  return x ^ (x >> 31);
 }
 
-adouble noise_model::score(const vector<string>& inputs, const Derivation& derivation) {
-  return 1.0;
+counter_rng::counter_rng(uint64_t seed, uint64_t stream) :
+  key(mix(seed ^ mix(stream + 0x9e3779b97f4a7c15ULL))), counter(0) {}
+
+uint64_t counter_rng::next() {
+  return mix(key + 0x9e3779b97f4a7c15ULL * ++counter);
 }
 
-Derivation noise_model::sample(const vector<string>& inputs) {
-  vector<string> chosen_translations;
+double counter_rng::uniform() {
+  // The top 53 bits fill a double's mantissa exactly
+  return (next() >> 11) * (1.0 / 9007199254740992.0);
+}
 
-  for (string w : inputs) {
-    map<string, double> translations = fwd_ttable->getTranslations(w);
-    double score_sum = 0.0;
-    for (auto kvp : translations) {
-      string translation = kvp.first;
-      double score = kvp.second;
-      score_sum += exp(score);
+noise_model::noise_model(ttable* fwd_ttable, const vector<vector<string> >& inputs) {
+  this->fwd_ttable = fwd_ttable;
+  for (const vector<string>& input : inputs) {
+    for (const string& word : input) {
+      if (tables.find(word) == tables.end()) {
+        build(word);
+      }
     }
+  }
+}
 
-    double r = score_sum * (double)rand() / RAND_MAX;
-    for (auto kvp : translations) {
-      string translation = kvp.first;
-      double score = kvp.second;
-      assert (translation.size() > 0);
-      if (r < exp(score)) {
-        chosen_translations.push_back(translation);
-        break;
-      }
-      r -= exp(score);
+void noise_model::build(const string& word) {
+  alias_table& table = tables[word];
+  vector<double> weights;
+  double score_sum = 0.0;
+  for (auto& kvp : fwd_ttable->getTranslations(word)) {
+    assert (kvp.first.size() > 0);
+    table.translations.push_back(kvp.first);
+    weights.push_back(exp(kvp.second));
+    score_sum += weights.back();
+  }
+
+  // Vose's construction: scale the weights to average one, then pair each
+  // entry below one with an entry above it, which tops it up.
+  const unsigned n = weights.size();
+  table.probability.assign(n, 1.0);
+  table.alias.resize(n);
+  vector<unsigned> small;
+  vector<unsigned> large;
+  for (unsigned i = 0; i < n; ++i) {
+    weights[i] *= n / score_sum;
+    table.alias[i] = i;
+    if (weights[i] < 1.0) {
+      small.push_back(i);
+    }
+    else {
+      large.push_back(i);
     }
   }
+  while (small.size() > 0 && large.size() > 0) {
+    const unsigned s = small.back();
+    const unsigned l = large.back();
+    small.pop_back();
+    table.probability[s] = weights[s];
+    table.alias[s] = l;
+    weights[l] -= 1.0 - weights[s];
+    if (weights[l] < 1.0) {
+      large.pop_back();
+      small.push_back(l);
+    }
+  }
+  // Whatever is left is one up to rounding error, and keeps probability 1
+}
+
+adouble noise_model::score(const vector<string>& inputs, const Derivation& derivation) {
+  return 1.0;
+}
 
-  vector<string> suffixes (inputs.size(), "");
-  vector<unsigned> permutation;
+Derivation noise_model::sample(const vector<string>& inputs, counter_rng& rng) const {
+  Derivation r;
   for (unsigned i = 0; i < inputs.size(); ++i) {
-    permutation.push_back(i);
+    auto it = tables.find(inputs[i]);
+    assert (it != tables.end());
+    const alias_table& table = it->second;
+    string translation;
+    if (table.translations.size() > 0) {
+      unsigned j = rng.next() % table.translations.size();
+      if (rng.uniform() >= table.probability[j]) {
+        j = table.alias[j];
+      }
+      translation = table.translations[j];
+      r.permutation.push_back(i);
+    }
+    r.translations.push_back(translation);
+    r.suffixes.push_back("");
   }
-
-  Derivation r {chosen_translations, suffixes, permutation};
   return r;
 }
 
+void noise_model::sample(const vector<vector<string> >& inputs, unsigned n, uint64_t seed,
+    thread_pool& pool, vector<vector<Derivation> >& samples) const {
+  samples.assign(inputs.size(), vector<Derivation>());
+  pool.run(inputs.size(), [&](size_t i) {
+    counter_rng rng(seed, i);
+    samples[i].reserve(n);
+    for (unsigned j = 0; j < n; ++j) {
+      samples[i].push_back(sample(inputs[i], rng));
+    }
+  });
+}
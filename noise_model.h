@@ -1,22 +1,61 @@
+#pragma once
+#include <cstdint>
 #include <vector>
 #include <string>
 #include <map>
+#include <unordered_map>
 #include "ttable.h"
 #include "utils.h"
 #include "derivation.h"
+#include "thread_pool.h"
 #include "adept.h"
 using std::map;
+using std::unordered_map;
 using std::vector;
 using std::string;
 using adept::adouble;
 
+// A counter-based random number generator: the nth number of a stream is
+// a hash of the seed, the stream and n, so there is no shared state.
+// Giving every example its own stream makes its samples the same however
+// examples are spread over threads.
+class counter_rng {
+public:
+  counter_rng(uint64_t seed, uint64_t stream);
+  uint64_t next();
+  // Uniform on [0, 1)
+  double uniform();
+
+private:
+  uint64_t key;
+  uint64_t counter;
+};
+
 class noise_model {
 public:
-  noise_model(ttable* fwd_ttable);
+  // Builds an alias table for the translations of every word in inputs,
+  // so sample may be called on any of them
+  noise_model(ttable* fwd_ttable, const vector<vector<string> >& inputs);
   adouble score(const vector<string>& input, const Derivation& derivation);
-  Derivation sample(const vector<string>& input);
+  // Draws each word's translation in proportion to exp of its ttable
+  // score, in constant time per word. Words with no translations are NULL.
+  Derivation sample(const vector<string>& input, counter_rng& rng) const;
+  // n samples of every input into samples, in parallel on pool. Input i
+  // draws from stream i of seed, so the samples do not depend on the
+  // number of threads.
+  void sample(const vector<vector<string> >& inputs, unsigned n, uint64_t seed,
+    thread_pool& pool, vector<vector<Derivation> >& samples) const;
 
 private:
+  // Walker's alias method: pick i uniformly, then keep it with
+  // probability[i] or take alias[i] instead.
+  struct alias_table {
+    vector<string> translations;
+    vector<double> probability;
+    vector<unsigned> alias;
+  };
+  void build(const string& word);
+
   ttable* fwd_ttable;
-  map<string, double> ttable_marginals;
+  unordered_map<string, alias_table> tables;
 };
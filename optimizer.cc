@@ -0,0 +1,204 @@
+#include <algorithm>
+#include <cassert>
+#include <cmath>
+#include <iostream>
+#include "optimizer.h"
+using namespace std;
+
+static double inner_product(const vector<double>& a, const vector<double>& b) {
+  assert (a.size() == b.size());
+  double r = 0.0;
+  for (size_t i = 0; i < a.size(); ++i) {
+    r += a[i] * b[i];
+  }
+  return r;
+}
+
+optimizer::optimizer() : value(0.0), norm(0.0), num_evaluations(0), done(false) {}
+
+optimizer::~optimizer() {}
+
+double optimizer::gradient_norm() const {
+  return norm;
+}
+
+unsigned optimizer::evaluations() const {
+  return num_evaluations;
+}
+
+bool optimizer::converged() const {
+  return done;
+}
+
+lbfgs::lbfgs(unsigned memory, double l1_strength) : memory(memory), l1_strength(l1_strength) {
+  assert (memory > 0);
+  assert (l1_strength >= 0.0);
+}
+
+// Value of f plus the L1 penalty at x; g gets the gradient of f alone
+double lbfgs::evaluate(const objective_function& f, const vector<double>& x, vector<double>& g) {
+  num_evaluations++;
+  double v = f(x, g);
+  assert (g.size() == x.size());
+  if (l1_strength > 0.0) {
+    for (double xi : x) {
+      v += l1_strength * fabs(xi);
+    }
+  }
+  return v;
+}
+
+// The gradient of f plus the L1 penalty where it exists. At zero, where
+// the penalty has no gradient, it is the one-sided derivative that points
+// downhill, or zero if neither side does.
+void lbfgs::pseudo_gradient(const vector<double>& x, vector<double>& pg) const {
+  pg = gradient;
+  if (l1_strength == 0.0) {
+    return;
+  }
+  for (size_t i = 0; i < x.size(); ++i) {
+    if (x[i] < 0.0) {
+      pg[i] -= l1_strength;
+    }
+    else if (x[i] > 0.0) {
+      pg[i] += l1_strength;
+    }
+    else if (gradient[i] + l1_strength < 0.0) {
+      pg[i] += l1_strength;
+    }
+    else if (gradient[i] - l1_strength > 0.0) {
+      pg[i] -= l1_strength;
+    }
+    else {
+      pg[i] = 0.0;
+    }
+  }
+}
+
+// The two-loop recursion: d = -H pg, where H approximates the inverse
+// Hessian from the stored steps.
+void lbfgs::direction(const vector<double>& pg, vector<double>& d) const {
+  vector<double> q = pg;
+  vector<double> alpha(s.size());
+  for (size_t k = s.size(); k-- > 0; ) {
+    alpha[k] = rho[k] * inner_product(s[k], q);
+    for (size_t i = 0; i < q.size(); ++i) {
+      q[i] -= alpha[k] * y[k][i];
+    }
+  }
+  if (s.size() > 0) {
+    const double gamma = inner_product(s.back(), y.back()) / inner_product(y.back(), y.back());
+    for (double& qi : q) {
+      qi *= gamma;
+    }
+  }
+  for (size_t k = 0; k < s.size(); ++k) {
+    const double beta = rho[k] * inner_product(y[k], q);
+    for (size_t i = 0; i < q.size(); ++i) {
+      q[i] += (alpha[k] - beta) * s[k][i];
+    }
+  }
+  d.resize(q.size());
+  for (size_t i = 0; i < q.size(); ++i) {
+    d[i] = -q[i];
+  }
+}
+
+double lbfgs::iterate(const objective_function& f, vector<double>& x) {
+  if (num_evaluations == 0) {
+    value = evaluate(f, x, gradient);
+  }
+
+  vector<double> pg;
+  pseudo_gradient(x, pg);
+  const double pg_norm = sqrt(inner_product(pg, pg));
+  if (pg_norm == 0.0) {
+    done = true;
+    norm = 0.0;
+    return value;
+  }
+  vector<double> d;
+  direction(pg, d);
+  if (l1_strength > 0.0) {
+    // OWL-QN only moves each weight the way its pseudo-gradient allows
+    for (size_t i = 0; i < d.size(); ++i) {
+      if (d[i] * pg[i] >= 0.0) {
+        d[i] = 0.0;
+      }
+    }
+  }
+  if (inner_product(d, pg) >= 0.0) {
+    // Not a descent direction, so the curvature pairs are no use
+    s.clear();
+    y.clear();
+    rho.clear();
+    for (size_t i = 0; i < d.size(); ++i) {
+      d[i] = -pg[i];
+    }
+  }
+
+  // The orthant each weight must stay in for this step
+  vector<double> orthant(x.size());
+  for (size_t i = 0; i < x.size(); ++i) {
+    orthant[i] = (x[i] != 0.0) ? x[i] : -pg[i];
+  }
+
+  // Backtracking line search for the Armijo condition. The first
+  // iteration has no curvature information, so it starts from a step of
+  // unit length rather than a unit multiple of the gradient.
+  const double c1 = 1.0e-4;
+  const unsigned max_backtracks = 30;
+  double step = (s.size() > 0) ? 1.0 : 1.0 / pg_norm;
+  vector<double> new_x(x.size());
+  vector<double> new_gradient;
+  double new_value = value;
+  bool accepted = false;
+  for (unsigned tries = 0; tries < max_backtracks; ++tries, step *= 0.5) {
+    double decrease = 0.0;
+    for (size_t i = 0; i < x.size(); ++i) {
+      new_x[i] = x[i] + step * d[i];
+      if (l1_strength > 0.0 && new_x[i] * orthant[i] <= 0.0) {
+        new_x[i] = 0.0;
+      }
+      decrease += pg[i] * (new_x[i] - x[i]);
+    }
+    new_value = evaluate(f, new_x, new_gradient);
+    if (new_value <= value + c1 * decrease) {
+      accepted = true;
+      break;
+    }
+  }
+
+  if (!accepted) {
+    cerr << "Line search failed to make progress." << endl;
+    done = true;
+    norm = pg_norm;
+    return value;
+  }
+
+  vector<double> new_s(x.size());
+  vector<double> new_y(x.size());
+  for (size_t i = 0; i < x.size(); ++i) {
+    new_s[i] = new_x[i] - x[i];
+    new_y[i] = new_gradient[i] - gradient[i];
+  }
+  const double sy = inner_product(new_s, new_y);
+  if (sy > 1.0e-10) {
+    if (s.size() == memory) {
+      s.erase(s.begin());
+      y.erase(y.begin());
+      rho.erase(rho.begin());
+    }
+    s.push_back(new_s);
+    y.push_back(new_y);
+    rho.push_back(1.0 / sy);
+  }
+
+  done = fabs(value - new_value) <= tolerance * max(1.0, fabs(new_value));
+  x.swap(new_x);
+  gradient.swap(new_gradient);
+  value = new_value;
+  pseudo_gradient(x, pg);
+  norm = sqrt(inner_product(pg, pg));
+  return value;
+}
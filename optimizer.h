@@ -0,0 +1,59 @@
+#pragma once
+#include <functional>
+#include <vector>
+using std::function;
+using std::vector;
+
+// An objective to minimize: returns its value at x and fills gradient
+// (resized to x.size()) with its gradient there.
+typedef function<double(const vector<double>& x, vector<double>& gradient)> objective_function;
+
+// A batch optimizer, which sees the whole objective at every step.
+class optimizer {
+public:
+  optimizer();
+  virtual ~optimizer();
+  // Moves x one iteration downhill on f and returns the objective there,
+  // including any penalty the optimizer adds itself. The first call also
+  // evaluates f at the starting point.
+  virtual double iterate(const objective_function& f, vector<double>& x) = 0;
+  // Norm of the gradient (for OWL-QN, the pseudo-gradient) at x
+  double gradient_norm() const;
+  // Number of times f has been evaluated
+  unsigned evaluations() const;
+  // Set once the objective stops improving by more than tolerance,
+  // relative to its value, or no step along the search direction helps.
+  bool converged() const;
+  double tolerance = 1.0e-6;
+
+protected:
+  double value;
+  vector<double> gradient;
+  double norm;
+  unsigned num_evaluations;
+  bool done;
+};
+
+// Limited-memory BFGS, using the last memory steps to approximate the
+// inverse Hessian, with a backtracking line search. With l1_strength > 0
+// this is OWL-QN (Andrew and Gao, 2007), which minimizes
+// f(x) + l1_strength * |x|_1 and keeps every step within one orthant, so
+// weights that the penalty drives to zero stay exactly zero.
+class lbfgs : public optimizer {
+public:
+  explicit lbfgs(unsigned memory = 10, double l1_strength = 0.0);
+  double iterate(const objective_function& f, vector<double>& x);
+
+private:
+  double evaluate(const objective_function& f, const vector<double>& x, vector<double>& g);
+  void pseudo_gradient(const vector<double>& x, vector<double>& pg) const;
+  void direction(const vector<double>& pg, vector<double>& d) const;
+
+  unsigned memory;
+  double l1_strength;
+  // The last memory steps s = x' - x and gradient changes y = g' - g,
+  // oldest first, with 1 / (y . s) for each
+  vector<vector<double> > s;
+  vector<vector<double> > y;
+  vector<double> rho;
+};
@@ -0,0 +1,109 @@
+#include <algorithm>
+#include <cassert>
+#include <cstdint>
+#include <queue>
+#include <unordered_map>
+#include "piece_matcher.h"
+using namespace std;
+
+const unsigned piece_matcher::none;
+
+piece_matcher::piece_matcher(const vector<string>& patterns) : patterns(patterns) {
+  // Build the trie, collecting edges as (parent, byte, child)
+  vector<tuple<unsigned, unsigned char, unsigned> > edges;
+  unordered_map<uint64_t, unsigned> trie;
+  output.push_back(none);
+  for (unsigned id = 0; id < patterns.size(); ++id) {
+    assert (patterns[id].size() > 0);
+    unsigned node = 0;
+    for (unsigned char c : patterns[id]) {
+      const uint64_t key = ((uint64_t)node << 8) | c;
+      auto it = trie.find(key);
+      if (it == trie.end()) {
+        const unsigned next = output.size();
+        output.push_back(none);
+        trie[key] = next;
+        edges.push_back(make_tuple(node, c, next));
+        node = next;
+      }
+      else {
+        node = it->second;
+      }
+    }
+    output[node] = id;
+  }
+
+  // Pack the edges by parent and byte
+  sort(edges.begin(), edges.end());
+  const unsigned num_nodes = output.size();
+  first_edge.assign(num_nodes + 1, 0);
+  for (auto& edge : edges) {
+    first_edge[get<0>(edge) + 1]++;
+    edge_bytes.push_back(get<1>(edge));
+    edge_targets.push_back(get<2>(edge));
+  }
+  for (unsigned n = 0; n < num_nodes; ++n) {
+    first_edge[n + 1] += first_edge[n];
+  }
+
+  // Fail links, breadth first from the root
+  fail.assign(num_nodes, 0);
+  next_output.assign(num_nodes, none);
+  queue<unsigned> frontier;
+  frontier.push(0);
+  while (!frontier.empty()) {
+    const unsigned node = frontier.front();
+    frontier.pop();
+    for (unsigned e = first_edge[node]; e < first_edge[node + 1]; ++e) {
+      const unsigned char c = edge_bytes[e];
+      const unsigned target = edge_targets[e];
+      if (node != 0) {
+        unsigned f = fail[node];
+        while (f != 0 && child(f, c) == none) {
+          f = fail[f];
+        }
+        const unsigned next = child(f, c);
+        fail[target] = (next != none) ? next : 0;
+      }
+      const unsigned f = fail[target];
+      next_output[target] = (output[f] != none) ? f : next_output[f];
+      frontier.push(target);
+    }
+  }
+}
+
+unsigned piece_matcher::child(unsigned node, unsigned char c) const {
+  auto begin = edge_bytes.begin() + first_edge[node];
+  auto end = edge_bytes.begin() + first_edge[node + 1];
+  auto it = lower_bound(begin, end, c);
+  if (it == end || *it != c) {
+    return none;
+  }
+  return edge_targets[it - edge_bytes.begin()];
+}
+
+void piece_matcher::match(const string& text, vector<tuple<unsigned, unsigned> >& matches) const {
+  unsigned node = 0;
+  for (unsigned i = 0; i < text.size(); ++i) {
+    const unsigned char c = text[i];
+    unsigned next = child(node, c);
+    while (next == none && node != 0) {
+      node = fail[node];
+      next = child(node, c);
+    }
+    node = (next != none) ? next : 0;
+
+    for (unsigned n = (output[node] != none) ? node : next_output[node]; n != none; n = next_output[n]) {
+      const unsigned id = output[n];
+      matches.push_back(make_tuple(id, i + 1 - patterns[id].size()));
+    }
+  }
+}
+
+const string& piece_matcher::pattern(unsigned id) const {
+  return patterns[id];
+}
+
+unsigned piece_matcher::size() const {
+  return patterns.size();
+}
@@ -0,0 +1,36 @@
+#pragma once
+#include <string>
+#include <tuple>
+#include <vector>
+using std::string;
+using std::tuple;
+using std::vector;
+
+// Aho-Corasick automaton over a fixed set of byte strings.
+// After construction, match() finds every occurrence of every pattern
+// in a text with a single left-to-right scan.
+class piece_matcher {
+public:
+  // Pattern i gets ID i. Patterns should be distinct and non-empty.
+  piece_matcher(const vector<string>& patterns);
+  // Appends (pattern ID, start offset) for each occurrence in text,
+  // in order of end offset.
+  void match(const string& text, vector<tuple<unsigned, unsigned> >& matches) const;
+  const string& pattern(unsigned id) const;
+  unsigned size() const;
+
+private:
+  unsigned child(unsigned node, unsigned char c) const;
+  vector<string> patterns;
+  // Children of node n are edge_bytes/edge_targets[first_edge[n], first_edge[n + 1]),
+  // sorted by byte.
+  vector<unsigned> first_edge;
+  vector<unsigned char> edge_bytes;
+  vector<unsigned> edge_targets;
+  vector<unsigned> fail;
+  // The pattern ending at each node, and the nearest node on the fail
+  // chain (excluding the node itself) where some pattern ends.
+  vector<unsigned> output;
+  vector<unsigned> next_output;
+  static const unsigned none = ~0u;
+};
@@ -5,41 +5,60 @@
 #include <sstream>
 #include <vector>
 #include <cassert>
+#include <cstdlib>
+#include <thread>
 #include "compound_analyzer.h"
+#include "line_pipeline.h"
 #include "utils.h"
 using namespace std;
 
 void ShowUsageAndExit(char** argv) {
-  cerr << "Usage: " << argv[0] << " fwd_ttable" << endl;
+  cerr << "Usage: " << argv[0] << " fwd_ttable [threads]" << endl;
   exit(1);
 }
 
+// Writes line back out if its last word can be built from the others
+void filter(compound_analyzer* analyzer, size_t line_number, const string& line, string& output) {
+  stringstream sstream(line);
+  vector<string> english;
+  string german;
+  string temp;
+  while (sstream >> temp) {
+    temp = to_lower_case(temp);
+    english.push_back(temp);
+  }
+  if (english.size() == 0) {
+    return;
+  }
+  german = english[english.size() - 1];
+  english.pop_back();
+  if (english.size() > compound_analyzer::max_words) {
+    cerr << "Skipping line " << line_number << ": more than " << compound_analyzer::max_words
+         << " English words." << endl;
+    return;
+  }
+
+  if (analyzer->isReachable(english, german)) {
+    output += line;
+    output += '\n';
+  }
+}
+
 int main(int argc, char** argv) {
   if (argc < 2) {
     ShowUsageAndExit(argv);
   }
+  const unsigned num_threads = (argc > 2) ? atoi(argv[2]) : thread::hardware_concurrency();
+  ios_base::sync_with_stdio(false);
   adept::Stack stack;
   ttable fwd_ttable;
   fwd_ttable.load(argv[1]);
   compound_analyzer analyzer(&fwd_ttable);
 
-  string line;
-  while (getline(cin, line)) {
-    stringstream sstream(line);
-    vector<string> english;
-    string german;
-    string temp;
-    while (sstream >> temp) {
-      temp = to_lower_case(temp);
-      english.push_back(temp);
-    }
-    german = english[english.size() - 1];
-    english.pop_back();
-
-    if (analyzer.isReachable(english, german)) {
-      cout << line << endl;
-    }
-  }
+  line_pipeline pipeline(num_threads);
+  pipeline.run(cin, cout, [&](unsigned worker, size_t line_number, const string& line, string& output) {
+    filter(&analyzer, line_number, line, output);
+  });
 
   return 0;
 }
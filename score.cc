@@ -0,0 +1,204 @@
+#include <iostream>
+#include <fstream>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <sstream>
+#include <unordered_map>
+#include <vector>
+#include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <limits>
+#include <thread>
+
+#include "adept.h"
+#include "crf.h"
+#include "feature_scorer.h"
+#include "line_pipeline.h"
+#include "utils.h"
+#include "derivation.h"
+using namespace std;
+
+// A worker's own Adept stack and copy of the model, created and
+// destroyed on the worker's thread (see crf::clone).
+struct scorer_state {
+  scorer_state(const crf& shared) : model(shared.clone(&stack)) {}
+  adept::Stack stack;
+  crf model;
+};
+
+// Log partition functions of the English spans seen so far, shared by
+// all workers. Two workers may both compute a span that neither has
+// finished yet; they get the same value, so the second insert is harmless.
+class partition_cache {
+public:
+  bool find(const string& span, double& log_z) {
+    lock_guard<mutex> lock(m);
+    auto it = cache.find(span);
+    if (it == cache.end()) {
+      return false;
+    }
+    log_z = it->second;
+    return true;
+  }
+  void insert(const string& span, double log_z) {
+    lock_guard<mutex> lock(m);
+    cache[span] = log_z;
+  }
+  size_t size() {
+    lock_guard<mutex> lock(m);
+    return cache.size();
+  }
+private:
+  mutex m;
+  unordered_map<string, double> cache;
+};
+
+void ShowUsageAndExit(char** argv) {
+  cerr << "Usage: " << argv[0] << " model.crf fwd_ttable rev_ttable target.vcb target.nlm [threads] [beam_size] [beam_threshold] < input" << endl;
+  cerr << "where each line of input is english span ||| translation+suffix ... ||| permutation" << endl;
+  cerr << "listing the non-NULL pieces in output order and the source index of each" << endl;
+  cerr << "beam_size and beam_threshold prune the lattice's partition function (see crf::beam_size)" << endl;
+  exit(1);
+}
+
+static vector<string> split_fields(const string& line) {
+  vector<string> fields;
+  size_t start = 0;
+  while (true) {
+    size_t end = line.find("|||", start);
+    fields.push_back(line.substr(start, end == string::npos ? string::npos : end - start));
+    if (end == string::npos) {
+      break;
+    }
+    start = end + 3;
+  }
+  return fields;
+}
+
+// Parses one input line into the English span and a derivation of it.
+// Returns false if the line is malformed.
+bool parse(const string& line, vector<string>& english, Derivation& derivation) {
+  vector<string> fields = split_fields(line);
+  if (fields.size() != 3) {
+    return false;
+  }
+
+  stringstream english_stream(fields[0]);
+  string word;
+  while (english_stream >> word) {
+    english.push_back(to_lower_case(word));
+  }
+
+  vector<string> pieces;
+  stringstream piece_stream(fields[1]);
+  while (piece_stream >> word) {
+    pieces.push_back(to_lower_case(word));
+  }
+
+  stringstream permutation_stream(fields[2]);
+  unsigned index;
+  while (permutation_stream >> index) {
+    derivation.permutation.push_back(index);
+  }
+
+  if (english.size() == 0 || english.size() > 5 || pieces.size() != derivation.permutation.size()) {
+    return false;
+  }
+  derivation.translations.assign(english.size(), "");
+  derivation.suffixes.assign(english.size(), "");
+  for (unsigned i = 0; i < pieces.size(); ++i) {
+    const unsigned j = derivation.permutation[i];
+    const size_t plus = pieces[i].rfind('+');
+    if (j >= english.size() || plus == string::npos || derivation.translations[j].size() > 0) {
+      return false;
+    }
+    derivation.translations[j] = pieces[i].substr(0, plus);
+    derivation.suffixes[j] = pieces[i].substr(plus + 1);
+  }
+  return true;
+}
+
+int main(int argc, char** argv) {
+  if (argc < 6) {
+    ShowUsageAndExit(argv);
+  }
+  const unsigned num_threads = (argc > 6) ? atoi(argv[6]) : thread::hardware_concurrency();
+  const unsigned beam_size = (argc > 7) ? atoi(argv[7]) : 0;
+  const double beam_threshold = (argc > 8) ? atof(argv[8]) : numeric_limits<double>::infinity();
+  ios_base::sync_with_stdio(false);
+
+  cerr << "Loading ttables..." << endl;
+  ttable fwd_ttable;
+  ttable rev_ttable;
+  fwd_ttable.load(argv[2]);
+  rev_ttable.load(argv[3]);
+
+  cerr << "Loading LM..." << endl;
+  adept::Stack stack;
+  vocabulary lm_vocab = vocabulary::ReadFromFile(argv[4]);
+  NeuralLM lm = NeuralLM::ReadFromFile(argv[5]);
+
+  feature_scorer scorer(&fwd_ttable, &rev_ttable);
+  scorer.lm_vocab = &lm_vocab;
+  scorer.lm = &lm;
+
+  cerr << "Loading model..." << endl;
+  crf model = crf::MapFromFile(&stack, &scorer, argv[1]);
+  model.add_suffix("");
+  model.beam_size = beam_size;
+  model.beam_threshold = beam_threshold;
+
+  // For each line, writes line ||| score ||| log partition function ||| log probability
+  partition_cache partitions;
+  line_pipeline pipeline(num_threads, 256);
+  pipeline.run(cin, cout, [&](unsigned worker, size_t line_number, const string& line, string& output) {
+    thread_local unique_ptr<scorer_state> state;
+    if (!state) {
+      state.reset(new scorer_state(model));
+    }
+
+    vector<string> english;
+    Derivation derivation;
+    if (!parse(line, english, derivation)) {
+      cerr << "Skipping malformed line " << line_number << "." << endl;
+      return;
+    }
+    // Features of words the model never saw score zero (see
+    // crf::ignore_unknown_features), but a suffix it doesn't know is never
+    // in the lattice, so such a derivation has no probability to report.
+    for (const string& suffix : derivation.suffixes) {
+      if (model.suffix_list.count(suffix) == 0) {
+        cerr << "Skipping line " << line_number << ": the model has no suffix \"" << suffix << "\"." << endl;
+        return;
+      }
+    }
+
+    // Nothing here needs gradients, but the LM features and the lattice
+    // still record onto the tape, so it is cleared for every line. The
+    // model score is computed in plain double, and the lattice is run
+    // once per distinct span.
+    state->stack.new_recording();
+    const double score = state->model.dot_value(scorer.score(english, derivation));
+    string span;
+    for (const string& word : english) {
+      span += word;
+      span += ' ';
+    }
+    double log_z;
+    if (!partitions.find(span, log_z)) {
+      log_z = state->model.lattice_partition_function(english).value();
+      partitions.insert(span, log_z);
+    }
+
+    char buffer[96];
+    snprintf(buffer, sizeof(buffer), " ||| %g ||| %g ||| %g\n", score, log_z, score - log_z);
+    output += to_string(line_number);
+    output += buffer;
+  });
+  cerr << partitions.size() << " distinct spans." << endl;
+
+  return 0;
+}
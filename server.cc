@@ -0,0 +1,399 @@
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <atomic>
+#include <condition_variable>
+#include <deque>
+#include <exception>
+#include <list>
+#include <string>
+#include <vector>
+#include <chrono>
+#include <cassert>
+#include <cerrno>
+#include <csignal>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
+#include <limits>
+#include <thread>
+
+#include <arpa/inet.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "adept.h"
+#include "crf.h"
+#include "decoding.h"
+#include "feature_scorer.h"
+#include "utils.h"
+using namespace std;
+
+// Protocol: every message in either direction is a frame made of a 4-byte
+// payload length in network byte order followed by the payload. A request
+// payload is a batch of English spans, one per line. The response payload
+// holds their k-best lists in the decoder's output format, with lines
+// numbered from 1 within the request. A span that can't be decoded gets
+// the single line "line ||| error ||| reason" instead. A client may send
+// any number of requests on one connection and closes it when done.
+const uint32_t max_frame = 64 << 20;
+const unsigned report_interval = 1000;
+
+static volatile sig_atomic_t stopping = 0;
+
+void stop(int sig) {
+  stopping = 1;
+}
+
+static bool read_all(int fd, char* p, size_t n) {
+  while (n > 0) {
+    ssize_t r = read(fd, p, n);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return false;
+    }
+    p += r;
+    n -= r;
+  }
+  return true;
+}
+
+static bool write_all(int fd, const char* p, size_t n) {
+  while (n > 0) {
+    ssize_t r = write(fd, p, n);
+    if (r < 0 && errno == EINTR) {
+      continue;
+    }
+    if (r <= 0) {
+      return false;
+    }
+    p += r;
+    n -= r;
+  }
+  return true;
+}
+
+static bool read_frame(int fd, string& payload) {
+  uint32_t length;
+  if (!read_all(fd, reinterpret_cast<char*>(&length), sizeof(length))) {
+    return false;
+  }
+  length = ntohl(length);
+  if (length > max_frame) {
+    cerr << "Dropping connection: frame of " << length << " bytes is too large." << endl;
+    return false;
+  }
+  payload.resize(length);
+  return length == 0 || read_all(fd, &payload[0], length);
+}
+
+static bool write_frame(int fd, const string& payload) {
+  assert (payload.size() <= max_frame);
+  const uint32_t length = htonl(payload.size());
+  return write_all(fd, reinterpret_cast<const char*>(&length), sizeof(length)) &&
+    write_all(fd, payload.data(), payload.size());
+}
+
+// Request latencies, in milliseconds, and how many requests ran out of
+// budget. Stats for the last report_interval requests are printed to
+// stderr as they complete.
+class latency_log {
+public:
+  void add(double ms, bool approximate) {
+    lock_guard<mutex> lock(m);
+    latencies.push_back(ms);
+    ++total;
+    if (approximate) {
+      ++budget_hits;
+    }
+    if (latencies.size() >= report_interval) {
+      report();
+    }
+  }
+  void flush() {
+    lock_guard<mutex> lock(m);
+    if (latencies.size() > 0) {
+      report();
+    }
+  }
+private:
+  void report() {
+    cerr << total << " requests served. Latency of the last " << latencies.size() << " (ms): p50 "
+         << percentile(latencies, 50.0) << ", p90 " << percentile(latencies, 90.0)
+         << ", p99 " << percentile(latencies, 99.0) << ", max " << percentile(latencies, 100.0)
+         << ". " << budget_hits << " ran out of budget." << endl;
+    latencies.clear();
+    budget_hits = 0;
+  }
+  mutex m;
+  vector<double> latencies;
+  size_t total = 0;
+  size_t budget_hits = 0;
+};
+
+// One client connection, served on its own thread. The main thread owns
+// the socket: it joins the thread once done is set, then closes it.
+struct connection {
+  int fd;
+  thread worker;
+  atomic<bool> done;
+};
+
+// A request being decoded. Its spans are queued separately, so workers
+// decode spans from different requests side by side; the connection that
+// sent it waits until remaining reaches zero.
+struct pending_request {
+  vector<string> lines;
+  vector<string> outputs;
+  vector<char> hit;
+  size_t remaining;
+  mutex m;
+  condition_variable finished;
+};
+
+// State shared by all connections. Spans from every request go into one
+// queue, served in arrival order by a fixed set of workers. Each worker
+// decodes with its own copy of the model, made once when it starts.
+struct server {
+  server(const crf& model, feature_scorer* scorer, unsigned k, double budget_ms, unsigned num_threads);
+  ~server();
+
+  string handle(const string& payload, bool& approximate);
+  void serve(connection* c);
+  void work();
+
+  const crf& model;
+  feature_scorer* scorer;
+  unsigned k;
+  double budget_ms;
+  vector<thread> workers;
+  mutex m;
+  condition_variable wake;
+  deque<pair<pending_request*, size_t> > spans;
+  bool shutting_down;
+  latency_log latencies;
+};
+
+server::server(const crf& model, feature_scorer* scorer, unsigned k, double budget_ms, unsigned num_threads) :
+    model(model), scorer(scorer), k(k), budget_ms(budget_ms), shutting_down(false) {
+  for (unsigned i = 0; i < max(num_threads, 1u); ++i) {
+    workers.push_back(thread(&server::work, this));
+  }
+}
+
+// Workers finish whatever is still queued before they exit
+server::~server() {
+  {
+    lock_guard<mutex> lock(m);
+    shutting_down = true;
+  }
+  wake.notify_all();
+  for (thread& worker : workers) {
+    worker.join();
+  }
+}
+
+void server::work() {
+  decoder_state state(model);
+  while (true) {
+    pair<pending_request*, size_t> span;
+    {
+      unique_lock<mutex> lock(m);
+      wake.wait(lock, [this] { return shutting_down || !spans.empty(); });
+      if (spans.empty()) {
+        return;
+      }
+      span = spans.front();
+      spans.pop_front();
+    }
+
+    // Nothing one span does may take down the server, so a failure is
+    // reported in that span's output and the worker carries on
+    pending_request& r = *span.first;
+    const size_t i = span.second;
+    vector<string> input;
+    string error;
+    if (read_span(r.lines[i], input, error)) {
+      try {
+        r.hit[i] = decode(state, scorer, i + 1, input, k, budget_ms, r.outputs[i]);
+      }
+      catch (const exception& e) {
+        r.outputs[i].clear();
+        error = string("decoding failed: ") + e.what();
+      }
+    }
+    if (error.size() > 0) {
+      cerr << "Span " << i + 1 << " of a request failed: " << error << "." << endl;
+      r.outputs[i] = to_string(i + 1) + " ||| error ||| " + error + "\n";
+    }
+    lock_guard<mutex> lock(r.m);
+    if (--r.remaining == 0) {
+      r.finished.notify_one();
+    }
+  }
+}
+
+// Sets approximate if any span of the request ran out of budget
+string server::handle(const string& payload, bool& approximate) {
+  pending_request r;
+  size_t start = 0;
+  while (start < payload.size()) {
+    size_t end = payload.find('\n', start);
+    if (end == string::npos) {
+      end = payload.size();
+    }
+    r.lines.push_back(payload.substr(start, end - start));
+    start = end + 1;
+  }
+
+  r.outputs.resize(r.lines.size());
+  r.hit.assign(r.lines.size(), 0);
+  r.remaining = r.lines.size();
+  if (r.remaining > 0) {
+    {
+      lock_guard<mutex> lock(m);
+      for (size_t i = 0; i < r.lines.size(); ++i) {
+        spans.push_back(make_pair(&r, i));
+      }
+    }
+    wake.notify_all();
+    unique_lock<mutex> lock(r.m);
+    r.finished.wait(lock, [&r] { return r.remaining == 0; });
+  }
+
+  string response;
+  approximate = false;
+  for (size_t i = 0; i < r.outputs.size(); ++i) {
+    response += r.outputs[i];
+    approximate = approximate || r.hit[i];
+  }
+  return response;
+}
+
+void server::serve(connection* c) {
+  const int fd = c->fd;
+  typedef chrono::steady_clock clock;
+  string request;
+  while (read_frame(fd, request)) {
+    const clock::time_point start = clock::now();
+    bool approximate;
+    const string response = handle(request, approximate);
+    if (response.size() > max_frame) {
+      cerr << "Dropping connection: response of " << response.size() << " bytes is too large." << endl;
+      break;
+    }
+    if (!write_frame(fd, response)) {
+      break;
+    }
+    latencies.add(chrono::duration<double, milli>(clock::now() - start).count(), approximate);
+  }
+  c->done = true;
+}
+
+void ShowUsageAndExit(char** argv) {
+  cerr << "Usage: " << argv[0] << " socket_path model.crf fwd_ttable rev_ttable target.vcb target.nlm [k] [threads] [budget_ms] [beam_size] [beam_threshold]" << endl;
+  cerr << "Serves k-best lists over a Unix domain socket until interrupted." << endl;
+  cerr << "beam_size and beam_threshold prune the lattice's partition function (see crf::beam_size)" << endl;
+  exit(1);
+}
+
+int main(int argc, char** argv) {
+  if (argc < 7) {
+    ShowUsageAndExit(argv);
+  }
+  const string socket_path = argv[1];
+  const unsigned k = (argc > 7) ? atoi(argv[7]) : 10;
+  const unsigned num_threads = (argc > 8) ? atoi(argv[8]) : thread::hardware_concurrency();
+  const double budget_ms = (argc > 9) ? atof(argv[9]) : 0.0;
+  const unsigned beam_size = (argc > 10) ? atoi(argv[10]) : 0;
+  const double beam_threshold = (argc > 11) ? atof(argv[11]) : numeric_limits<double>::infinity();
+
+  cerr << "Loading ttables..." << endl;
+  ttable fwd_ttable;
+  ttable rev_ttable;
+  fwd_ttable.load(argv[3]);
+  rev_ttable.load(argv[4]);
+
+  cerr << "Loading LM..." << endl;
+  adept::Stack stack;
+  vocabulary lm_vocab = vocabulary::ReadFromFile(argv[5]);
+  NeuralLM lm = NeuralLM::ReadFromFile(argv[6]);
+
+  feature_scorer scorer(&fwd_ttable, &rev_ttable);
+  scorer.lm_vocab = &lm_vocab;
+  scorer.lm = &lm;
+
+  cerr << "Loading model..." << endl;
+  crf model = crf::MapFromFile(&stack, &scorer, argv[2]);
+  model.add_suffix("");
+  model.beam_size = beam_size;
+  model.beam_threshold = beam_threshold;
+
+  sockaddr_un address;
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  if (socket_path.size() >= sizeof(address.sun_path)) {
+    cerr << "Socket path " << socket_path << " is too long." << endl;
+    return 1;
+  }
+  strcpy(address.sun_path, socket_path.c_str());
+  int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+  unlink(socket_path.c_str());
+  if (listener < 0 || ::bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof(address)) != 0 ||
+      listen(listener, 64) != 0) {
+    cerr << "Unable to listen on " << socket_path << ": " << strerror(errno) << endl;
+    return 1;
+  }
+
+  signal(SIGPIPE, SIG_IGN);
+  signal(SIGINT, stop);
+  signal(SIGTERM, stop);
+
+  server s(model, &scorer, k, budget_ms, num_threads);
+  cerr << "Listening on " << socket_path << " with " << s.workers.size() << " threads." << endl;
+  list<unique_ptr<connection> > connections;
+  while (!stopping) {
+    for (auto it = connections.begin(); it != connections.end(); ) {
+      if ((*it)->done) {
+        (*it)->worker.join();
+        close((*it)->fd);
+        it = connections.erase(it);
+      }
+      else {
+        ++it;
+      }
+    }
+
+    pollfd p;
+    p.fd = listener;
+    p.events = POLLIN;
+    if (poll(&p, 1, 500) <= 0) {
+      continue;
+    }
+    int fd = accept(listener, NULL, NULL);
+    if (fd < 0) {
+      continue;
+    }
+    connection* c = new connection();
+    c->fd = fd;
+    c->done = false;
+    connections.push_back(unique_ptr<connection>(c));
+    c->worker = thread(&server::serve, &s, c);
+  }
+
+  cerr << "Shutting down..." << endl;
+  close(listener);
+  unlink(socket_path.c_str());
+  for (unique_ptr<connection>& c : connections) {
+    shutdown(c->fd, SHUT_RDWR);
+    c->worker.join();
+    close(c->fd);
+  }
+  s.latencies.flush();
+
+  return 0;
+}
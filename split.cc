@@ -5,45 +5,65 @@
 #include <sstream>
 #include <vector>
 #include <cassert>
+#include <cstdio>
+#include <cstdlib>
+#include <thread>
 #include "compound_analyzer.h"
 #include "feature_scorer.h"
+#include "line_pipeline.h"
 #include "utils.h"
 #include "derivation.h"
 using namespace std;
 
-void process(int line_number, const vector<string>& english, string german,
-    compound_analyzer* analyzer, feature_scorer* scorer) {
+// Formats like the default ostream << double, i.e. printf's %g
+static void append_number(string& output, double value) {
+  char buffer[32];
+  snprintf(buffer, sizeof(buffer), "%g", value);
+  output += buffer;
+}
+
+// Appends one record per derivation of the line to output
+void process(size_t line_number, const vector<string>& english, string german,
+    compound_analyzer* analyzer, feature_scorer* scorer, string& output) {
 
+  const string prefix = to_string(line_number) + " ||| ";
   for (Derivation& derivation : analyzer->analyze(english, german, false)) {
     vector<string>& translations = derivation.translations;
     vector<string>& suffixes = derivation.suffixes;
     vector<unsigned>& indices = derivation.permutation;
 
-    cout << line_number << " ||| ";
+    output += prefix;
 
     // Output the translations and suffixes
     for (unsigned i = 0; i < indices.size(); ++i) {
-      cout << translations[indices[i]] << "+" << suffixes[i] << " ";
+      output += translations[indices[i]];
+      output += '+';
+      output += suffixes[i];
+      output += ' ';
     }
-    cout << "||| ";
+    output += "||| ";
 
     // Output the permutation
     for (unsigned i = 0; i < indices.size(); ++i) {
-      cout << indices[i] << " ";
+      output += to_string(indices[i]);
+      output += ' ';
     }
-    cout << "||| ";
+    output += "||| ";
 
     // Output the features
     map<string, double> features = scorer->score(english, derivation);
     for (auto it = features.begin(); it != features.end(); ++it) {
-      cout << it->first << "=" << it->second << " ";
+      output += it->first;
+      output += '=';
+      append_number(output, it->second);
+      output += ' ';
     }
-    cout << endl;
+    output += '\n';
   }
 }
 
 void ShowUsageAndExit(char** argv) {
-  cerr << "Usage: " << argv[0] << " fwd_ttable rev_ttable" << endl;
+  cerr << "Usage: " << argv[0] << " fwd_ttable rev_ttable [threads]" << endl;
   exit(1);
 }
 
@@ -51,6 +71,8 @@ int main(int argc, char** argv) {
   if (argc < 3) {
     ShowUsageAndExit(argv);
   }
+  const unsigned num_threads = (argc > 3) ? atoi(argv[3]) : thread::hardware_concurrency();
+  ios_base::sync_with_stdio(false);
   adept::Stack stack;
   ttable fwd_ttable;
   ttable rev_ttable;
@@ -59,11 +81,9 @@ int main(int argc, char** argv) {
   feature_scorer scorer(&fwd_ttable, &rev_ttable);
   compound_analyzer analyzer(&fwd_ttable);
 
-  string line;
-  int line_number = 0;
-  while (getline(cin, line)) {
+  line_pipeline pipeline(num_threads);
+  pipeline.run(cin, cout, [&](unsigned worker, size_t line_number, const string& line, string& output) {
     stringstream sstream(line);
-    line_number++;
     vector<string> english;
     string german;
     string temp;
@@ -71,11 +91,19 @@ int main(int argc, char** argv) {
       temp = to_lower_case(temp);
       english.push_back(temp);
     }
+    if (english.size() == 0) {
+      return;
+    }
     german = english[english.size() - 1];
     english.pop_back();
+    if (english.size() > compound_analyzer::max_words) {
+      cerr << "Skipping line " << line_number << ": more than " << compound_analyzer::max_words
+           << " English words." << endl;
+      return;
+    }
 
-    process(line_number, english, german, &analyzer, &scorer);
-  }
+    process(line_number, english, german, &analyzer, &scorer, output);
+  });
 
   return 0;
 }
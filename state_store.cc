@@ -0,0 +1,288 @@
+#include <cassert>
+#include <algorithm>
+#include "state_store.h"
+using namespace std;
+
+const unsigned id_table::none;
+
+static inline uint64_t pack(unsigned a, unsigned b) {
+  return ((uint64_t)a << 32) | b;
+}
+
+id_table::id_table() : shift(58), generation(1), used(0) {
+  keys.resize(64);
+  ids.resize(64);
+  stamps.resize(64, 0);
+}
+
+size_t id_table::slot(uint64_t key) const {
+  // Fibonacci hashing: the table size is 2^(64 - shift)
+  size_t i = (size_t)((key * 0x9e3779b97f4a7c15ULL) >> shift);
+  while (stamps[i] == generation && keys[i] != key) {
+    i = (i + 1) & (keys.size() - 1);
+  }
+  return i;
+}
+
+unsigned id_table::find(uint64_t key) const {
+  size_t i = slot(key);
+  return stamps[i] == generation ? ids[i] : none;
+}
+
+void id_table::insert(uint64_t key, unsigned id) {
+  if (2 * (used + 1) > keys.size()) {
+    grow();
+  }
+  size_t i = slot(key);
+  if (stamps[i] != generation) {
+    used++;
+  }
+  keys[i] = key;
+  ids[i] = id;
+  stamps[i] = generation;
+}
+
+void id_table::clear() {
+  used = 0;
+  generation++;
+  if (generation == 0) {
+    fill(stamps.begin(), stamps.end(), 0);
+    generation = 1;
+  }
+}
+
+void id_table::grow() {
+  vector<uint64_t> old_keys(keys.size() * 2);
+  vector<unsigned> old_ids(ids.size() * 2);
+  vector<unsigned> old_stamps(stamps.size() * 2, 0);
+  old_keys.swap(keys);
+  old_ids.swap(ids);
+  old_stamps.swap(stamps);
+  shift--;
+  for (size_t i = 0; i < old_keys.size(); ++i) {
+    if (old_stamps[i] == generation) {
+      size_t j = slot(old_keys[i]);
+      keys[j] = old_keys[i];
+      ids[j] = old_ids[i];
+      stamps[j] = generation;
+    }
+  }
+}
+
+state_store::state_store() : num_contexts(0), num_states(0), num_prefixes(0) {}
+
+void state_store::reset(unsigned num_steps) {
+  num_contexts = 0;
+  context_ids.clear();
+  transition_targets.clear();
+  transition_log_probs.clear();
+  transition_ids.clear();
+  permutation_parents.assign(1, 0);
+  permutation_indices.assign(1, 0);
+  permutation_ids.clear();
+  state_coverages.clear();
+  state_permutations.clear();
+  state_contexts.clear();
+  num_states = 0;
+  num_prefixes = 0;
+  prefix_ids.clear();
+  state_ids.clear();
+  if (step_states.size() < num_steps) {
+    step_states.resize(num_steps);
+  }
+  for (vector<unsigned>& states : step_states) {
+    states.clear();
+  }
+}
+
+unsigned state_store::add_context(const Context& context) {
+  auto it = context_ids.find(context);
+  if (it != context_ids.end()) {
+    return it->second;
+  }
+  const unsigned id = num_contexts++;
+  if (id < contexts.size()) {
+    contexts[id] = context;
+  }
+  else {
+    contexts.push_back(context);
+  }
+  context_ids[context] = id;
+  return id;
+}
+
+const Context& state_store::context(unsigned id) const {
+  assert (id < num_contexts);
+  return contexts[id];
+}
+
+unsigned state_store::transition(unsigned context, unsigned letter, NeuralLM* lm) {
+  const uint64_t key = pack(context, letter);
+  unsigned id = transition_ids.find(key);
+  if (id != id_table::none) {
+    return id;
+  }
+  Context next = contexts[context];
+  adouble log_prob = lm->log_prob(next, letter);
+  next.add(letter);
+  id = transition_targets.size();
+  transition_targets.push_back(add_context(next));
+  transition_log_probs.push_back(log_prob);
+  transition_ids.insert(key, id);
+  return id;
+}
+
+void state_store::add_transitions(const vector<unsigned>& starts,
+    const vector<const vector<unsigned>*>& letters, NeuralLM* lm, thread_pool& threads) {
+  assert (starts.size() == letters.size());
+  assert (threads.size() > 1);
+  vector<unsigned> current(starts);
+  vector<Context> pending_contexts;
+  vector<unsigned> pending_from;
+  vector<unsigned> pending_letters;
+  vector<double> log_probs;
+  for (unsigned depth = 0; ; ++depth) {
+    // Collect the distinct transitions at this depth that are not known yet
+    bool done = true;
+    pending_ids.clear();
+    pending_contexts.clear();
+    pending_from.clear();
+    pending_letters.clear();
+    for (unsigned w = 0; w < current.size(); ++w) {
+      if (depth >= letters[w]->size()) {
+        continue;
+      }
+      done = false;
+      const unsigned letter = (*letters[w])[depth];
+      const uint64_t key = pack(current[w], letter);
+      if (transition_ids.find(key) != id_table::none || pending_ids.find(key) != id_table::none) {
+        continue;
+      }
+      pending_ids.insert(key, pending_from.size());
+      pending_contexts.push_back(contexts[current[w]]);
+      pending_from.push_back(current[w]);
+      pending_letters.push_back(letter);
+    }
+    if (done) {
+      break;
+    }
+
+    const size_t n = pending_letters.size();
+    const size_t chunks = min<size_t>(threads.size(), n);
+    log_probs.resize(n);
+    threads.run(chunks, [&](size_t c) {
+      // Each worker keeps its own stack for as long as it lives. Only the
+      // values are kept, so every chunk starts a fresh recording.
+      static thread_local adept::Stack stack;
+      stack.new_recording();
+      const size_t end = n * (c + 1) / chunks;
+      for (size_t j = n * c / chunks; j < end; ++j) {
+        log_probs[j] = lm->log_prob(pending_contexts[j], pending_letters[j]).value();
+      }
+    });
+
+    for (unsigned j = 0; j < pending_letters.size(); ++j) {
+      Context next = pending_contexts[j];
+      next.add(pending_letters[j]);
+      const unsigned id = transition_targets.size();
+      transition_targets.push_back(add_context(next));
+      transition_log_probs.push_back(log_probs[j]);
+      transition_ids.insert(pack(pending_from[j], pending_letters[j]), id);
+    }
+
+    for (unsigned w = 0; w < current.size(); ++w) {
+      if (depth < letters[w]->size()) {
+        const uint64_t key = pack(current[w], (*letters[w])[depth]);
+        current[w] = transition_targets[transition_ids.find(key)];
+      }
+    }
+  }
+}
+
+unsigned state_store::transition_target(unsigned id) const {
+  return transition_targets[id];
+}
+
+const adouble& state_store::transition_log_prob(unsigned id) const {
+  return transition_log_probs[id];
+}
+
+unsigned state_store::extend_permutation(unsigned permutation, unsigned index) {
+  const uint64_t key = pack(permutation, index);
+  unsigned id = permutation_ids.find(key);
+  if (id == id_table::none) {
+    id = permutation_parents.size();
+    permutation_parents.push_back(permutation);
+    permutation_indices.push_back(index);
+    permutation_ids.insert(key, id);
+  }
+  return id;
+}
+
+vector<unsigned> state_store::permutation(unsigned id) const {
+  vector<unsigned> r;
+  for (; id != 0; id = permutation_parents[id]) {
+    r.push_back(permutation_indices[id]);
+  }
+  reverse(r.begin(), r.end());
+  return r;
+}
+
+unsigned state_store::add_state(unsigned step, unsigned coverage, unsigned permutation, unsigned context) {
+  const uint64_t prefix_key = pack(coverage, permutation);
+  unsigned prefix = prefix_ids.find(prefix_key);
+  if (prefix == id_table::none) {
+    prefix = num_prefixes++;
+    prefix_ids.insert(prefix_key, prefix);
+  }
+
+  const uint64_t key = pack(prefix, context);
+  unsigned id = state_ids.find(key);
+  if (id != id_table::none) {
+    return id;
+  }
+
+  id = num_states++;
+  state_coverages.push_back(coverage);
+  state_permutations.push_back(permutation);
+  state_contexts.push_back(context);
+  if (id < state_incoming.size()) {
+    state_incoming[id].clear();
+  }
+  else {
+    state_incoming.push_back(vector<adouble>());
+  }
+  state_ids.insert(key, id);
+  assert (step < step_states.size());
+  step_states[step].push_back(id);
+  return id;
+}
+
+unsigned state_store::coverage(unsigned state) const {
+  return state_coverages[state];
+}
+
+unsigned state_store::permutation_of(unsigned state) const {
+  return state_permutations[state];
+}
+
+unsigned state_store::context_of(unsigned state) const {
+  return state_contexts[state];
+}
+
+vector<adouble>& state_store::incoming(unsigned state) {
+  assert (state < num_states);
+  return state_incoming[state];
+}
+
+vector<unsigned>& state_store::states(unsigned step) {
+  return step_states[step];
+}
+
+unsigned state_store::num_transitions() const {
+  return transition_targets.size();
+}
+
+unsigned state_store::size() const {
+  return num_states;
+}
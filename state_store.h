@@ -0,0 +1,100 @@
+#pragma once
+#include <cstdint>
+#include <vector>
+#include <unordered_map>
+#include "adept.h"
+#include "NeuralLM/context.h"
+#include "NeuralLM/neurallm.h"
+#include "thread_pool.h"
+using std::vector;
+using std::unordered_map;
+using adept::adouble;
+
+// Maps 64-bit keys to dense IDs with open addressing.
+// clear() is O(1) and keeps the table's memory for the next example.
+class id_table {
+public:
+  static const unsigned none = ~0u;
+  id_table();
+  unsigned find(uint64_t key) const;
+  void insert(uint64_t key, unsigned id);
+  void clear();
+private:
+  size_t slot(uint64_t key) const;
+  void grow();
+  vector<uint64_t> keys;
+  vector<unsigned> ids;
+  vector<unsigned> stamps;
+  unsigned shift;
+  unsigned generation;
+  size_t used;
+};
+
+// The states of one lattice_partition_function call.
+// A state is a coverage bitvector, a list of used source indices, and an
+// LM context. Each distinct state is interned once and referred to by a
+// dense integer ID, with its parts and incoming scores kept in parallel
+// arrays. Permutations are stored as a trie (ID 0 is the empty one) and
+// contexts are interned along with the LM transitions between them, so
+// each (context, letter) pair is scored by the LM only once.
+// reset() forgets everything but keeps the allocated memory, so after the
+// first few examples building a lattice allocates almost nothing.
+class state_store {
+public:
+  state_store();
+  void reset(unsigned num_steps);
+
+  unsigned add_context(const Context& context);
+  const Context& context(unsigned id) const;
+  // Returns the ID of the transition from context on letter,
+  // querying the LM only if it has not been seen before.
+  unsigned transition(unsigned context, unsigned letter, NeuralLM* lm);
+  unsigned transition_target(unsigned id) const;
+  // Adds every transition needed to spell each walk's letters starting from
+  // its start context. The LM queries for each letter position are split across
+  // the workers of threads, which must not run jobs on the calling thread.
+  // Each worker has its own Adept stack, and only the values are kept.
+  // IDs are then assigned in walk order, so the lattice built afterwards
+  // does not depend on the number of threads.
+  void add_transitions(const vector<unsigned>& starts,
+    const vector<const vector<unsigned>*>& letters, NeuralLM* lm, thread_pool& threads);
+  const adouble& transition_log_prob(unsigned id) const;
+  // Number of distinct transitions, i.e. LM queries, since reset()
+  unsigned num_transitions() const;
+
+  unsigned extend_permutation(unsigned permutation, unsigned index);
+  vector<unsigned> permutation(unsigned id) const;
+
+  // Returns the ID of the state, adding it to the given step if it is new
+  unsigned add_state(unsigned step, unsigned coverage, unsigned permutation, unsigned context);
+  unsigned coverage(unsigned state) const;
+  unsigned permutation_of(unsigned state) const;
+  unsigned context_of(unsigned state) const;
+  vector<adouble>& incoming(unsigned state);
+  vector<unsigned>& states(unsigned step);
+  unsigned size() const;
+
+private:
+  vector<Context> contexts;
+  unsigned num_contexts;
+  unordered_map<Context, unsigned> context_ids;
+
+  vector<unsigned> transition_targets;
+  vector<adouble> transition_log_probs;
+  id_table transition_ids;
+  id_table pending_ids;
+
+  vector<unsigned> permutation_parents;
+  vector<unsigned> permutation_indices;
+  id_table permutation_ids;
+
+  vector<unsigned> state_coverages;
+  vector<unsigned> state_permutations;
+  vector<unsigned> state_contexts;
+  vector<vector<adouble> > state_incoming;
+  unsigned num_states;
+  unsigned num_prefixes;
+  id_table prefix_ids;
+  id_table state_ids;
+  vector<vector<unsigned> > step_states;
+};
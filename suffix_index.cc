@@ -0,0 +1,102 @@
+#include <algorithm>
+#include <cassert>
+#include <limits>
+#include "suffix_index.h"
+using namespace std;
+
+suffix_index::suffix_index(unsigned max_ending) : max_length(max_ending), no_suffix(1, "") {
+  assert (max_ending > 0);
+}
+
+string suffix_index::ending(const string& root, unsigned n) {
+  size_t start = root.size();
+  while (start > 0 && n > 0) {
+    --start;
+    // Continuation bytes of a UTF-8 character look like 10xxxxxx
+    if (((unsigned char)root[start] & 0xC0) != 0x80) {
+      --n;
+    }
+  }
+  return root.substr(start);
+}
+
+void suffix_index::add_entry(const string& e, const string& suffix) {
+  vector<string>& s = suffixes[e];
+  if (s.size() == 0) {
+    s.push_back("");
+  }
+  if (std::find(s.begin(), s.end(), suffix) == s.end()) {
+    s.push_back(suffix);
+  }
+}
+
+void suffix_index::add(const string& root, const string& suffix) {
+  if (root.size() == 0) {
+    return;
+  }
+  for (unsigned n = 1; n <= max_length; ++n) {
+    const string e = ending(root, n);
+    add_entry(e, suffix);
+    if (e.size() == root.size()) {
+      break;
+    }
+  }
+}
+
+void suffix_index::prune(const unordered_map<string, double>& scores, double margin) {
+  for (auto& kvp : suffixes) {
+    vector<string>& s = kvp.second;
+    double best = -numeric_limits<double>::infinity();
+    for (const string& suffix : s) {
+      auto it = scores.find(suffix);
+      if (it != scores.end()) {
+        best = max(best, it->second);
+      }
+    }
+    s.erase(std::remove_if(s.begin(), s.end(), [&](const string& suffix) {
+      auto it = scores.find(suffix);
+      return suffix.size() > 0 && it != scores.end() && it->second < best - margin;
+    }), s.end());
+  }
+}
+
+bool suffix_index::allows(const string& suffix) const {
+  for (auto& kvp : suffixes) {
+    if (std::find(kvp.second.begin(), kvp.second.end(), suffix) != kvp.second.end()) {
+      return true;
+    }
+  }
+  return false;
+}
+
+bool suffix_index::empty() const {
+  return suffixes.size() == 0;
+}
+
+unsigned suffix_index::max_ending() const {
+  return max_length;
+}
+
+const vector<string>* suffix_index::find(const string& root) const {
+  if (root.size() == 0) {
+    return &no_suffix;
+  }
+  for (unsigned n = max_length; n > 0; --n) {
+    auto it = suffixes.find(ending(root, n));
+    if (it != suffixes.end()) {
+      return &it->second;
+    }
+  }
+  return back_off ? NULL : &no_suffix;
+}
+
+vector<pair<string, string> > suffix_index::entries() const {
+  vector<pair<string, string> > r;
+  for (auto& kvp : suffixes) {
+    for (const string& suffix : kvp.second) {
+      r.push_back(make_pair(kvp.first, suffix));
+    }
+  }
+  sort(r.begin(), r.end());
+  return r;
+}
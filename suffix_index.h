@@ -0,0 +1,47 @@
+#pragma once
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+using std::pair;
+using std::string;
+using std::unordered_map;
+using std::vector;
+
+// Which suffixes a root may take, learned from the training derivations.
+// Roots are classed by their last max_ending characters, backing off to
+// shorter endings: a root takes the suffixes seen after the longest of
+// its endings that was seen in training. The empty suffix is always
+// allowed. Roots none of whose endings were seen take every suffix if
+// back_off is set, and only the empty suffix otherwise.
+class suffix_index {
+public:
+  explicit suffix_index(unsigned max_ending = 3);
+
+  void add(const string& root, const string& suffix);
+  // Drops from each ending's suffixes those whose score is more than
+  // margin below the best of them. The empty suffix, and suffixes with no
+  // score, are kept.
+  void prune(const unordered_map<string, double>& scores, double margin);
+  // Whether any ending allows suffix
+  bool allows(const string& suffix) const;
+  bool empty() const;
+  unsigned max_ending() const;
+  // The suffixes allowed after root, or NULL if it takes all of them
+  const vector<string>* find(const string& root) const;
+
+  // Every (ending, suffix) pair, for saving the index with a model.
+  // Adding them back to an index with the same max_ending restores it.
+  vector<pair<string, string> > entries() const;
+  void add_entry(const string& ending, const string& suffix);
+
+  bool back_off = true;
+
+private:
+  // The last n UTF-8 characters of root, or all of it if it is shorter
+  static string ending(const string& root, unsigned n);
+
+  unsigned max_length;
+  unordered_map<string, vector<string> > suffixes;
+  vector<string> no_suffix;
+};
@@ -0,0 +1,72 @@
+#include "thread_pool.h"
+using namespace std;
+
+thread_pool::thread_pool(unsigned num_threads) :
+    job(NULL), total(0), next(0), busy(0), batch(0), stopping(false) {
+  if (num_threads > 1) {
+    for (unsigned i = 0; i < num_threads; ++i) {
+      workers.push_back(thread(&thread_pool::work, this));
+    }
+  }
+}
+
+thread_pool::~thread_pool() {
+  {
+    lock_guard<mutex> lock(m);
+    stopping = true;
+  }
+  wake.notify_all();
+  for (thread& worker : workers) {
+    worker.join();
+  }
+}
+
+unsigned thread_pool::size() const {
+  return workers.empty() ? 1 : workers.size();
+}
+
+void thread_pool::run(size_t n, const function<void(size_t)>& f) {
+  if (workers.empty()) {
+    for (size_t i = 0; i < n; ++i) {
+      f(i);
+    }
+    return;
+  }
+
+  unique_lock<mutex> lock(m);
+  job = &f;
+  total = n;
+  next = 0;
+  busy = workers.size();
+  ++batch;
+  wake.notify_all();
+  finished.wait(lock, [this] { return busy == 0; });
+  job = NULL;
+}
+
+void thread_pool::work() {
+  unsigned seen = 0;
+  while (true) {
+    const function<void(size_t)>* f;
+    size_t n;
+    {
+      unique_lock<mutex> lock(m);
+      wake.wait(lock, [this, seen] { return stopping || batch != seen; });
+      if (stopping) {
+        return;
+      }
+      seen = batch;
+      f = job;
+      n = total;
+    }
+
+    for (size_t i = next++; i < n; i = next++) {
+      (*f)(i);
+    }
+
+    lock_guard<mutex> lock(m);
+    if (--busy == 0) {
+      finished.notify_one();
+    }
+  }
+}
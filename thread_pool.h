@@ -0,0 +1,43 @@
+#pragma once
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+using std::atomic;
+using std::condition_variable;
+using std::function;
+using std::mutex;
+using std::thread;
+using std::vector;
+
+// A fixed set of worker threads that run batches of independent jobs.
+// With one thread (or zero) jobs run on the calling thread.
+class thread_pool {
+public:
+  explicit thread_pool(unsigned num_threads);
+  ~thread_pool();
+  unsigned size() const;
+  // Calls job(i) for every i in [0, n) and returns once all calls have
+  // finished. Indices are handed out in increasing order to whichever
+  // worker is free, so callers that write result i into slot i get their
+  // results in input order regardless of scheduling.
+  void run(size_t n, const function<void(size_t)>& job);
+
+private:
+  thread_pool(const thread_pool&);
+  thread_pool& operator=(const thread_pool&);
+  void work();
+
+  vector<thread> workers;
+  mutex m;
+  condition_variable wake;
+  condition_variable finished;
+  const function<void(size_t)>* job;
+  size_t total;
+  atomic<size_t> next;
+  unsigned busy;
+  unsigned batch;
+  bool stopping;
+};
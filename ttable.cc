@@ -1,19 +1,22 @@
 #include <sstream>
 #include <iostream>
 #include <fstream>
+#include <set>
 #include "ttable.h"
 #include "utils.h"
 using namespace std;
 
-bool ttable::getScore(string source, string target, double& score) {
-  if (table.find(source) == table.end()) {
+bool ttable::getScore(const string& source, const string& target, double& score) {
+  auto row = table.find(source);
+  if (row == table.end()) {
     return false;
   }
-  else if (table[source].find(target) == table[source].end()) {
+  auto cell = row->second.find(target);
+  if (cell == row->second.end()) {
     return false;
   }
   else {
-    score = table[source][target];
+    score = cell->second;
     return true;
   }
 }
@@ -25,13 +28,26 @@ void ttable::setScore(string source, string target, double score) {
   table[source][target] = score;
 }
 
+// Only reads the table, so it is safe to call from several threads at once.
 map<string, double> ttable::getTranslations(string source) {
-  if (table.find(source) == table.end()) {
+  auto row = table.find(source);
+  if (row == table.end()) {
     map<string, double> empty_map;
     return empty_map;
   }
 
-  return table[source];
+  return row->second;
+}
+
+// Returns every distinct target string in the table, sorted
+vector<string> ttable::getTargets() {
+  set<string> targets;
+  for (auto& row : table) {
+    for (auto& kvp : row.second) {
+      targets.insert(kvp.first);
+    }
+  }
+  return vector<string>(targets.begin(), targets.end());
 }
 
 void ttable::load(string filename) {
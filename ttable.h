@@ -5,9 +5,10 @@
 
 class ttable {
 public:
-  bool getScore(std::string source, std::string target, double& score);
+  bool getScore(const std::string& source, const std::string& target, double& score);
   void setScore(std::string source, std::string target, double score);
   std::map<std::string, double> getTranslations(std::string source);
+  std::vector<std::string> getTargets();
   void load(std::string filename);
 private:
   std::map<std::string, std::map<std::string, double> > table;
@@ -1,6 +1,13 @@
 #include <algorithm>
 #include <cassert>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
 #include <fstream>
+#include <limits>
+#if defined(__AVX2__) || defined(__AVX512F__)
+#include <immintrin.h>
+#endif
 #include <Eigen/Dense>
 #include "utils.h"
 using namespace std;
@@ -12,41 +19,35 @@ string to_lower_case(string s) {
   return t;
 }
 
-vector<vector<string> > cross(vector<vector<string> > vectors ) {
-  vector<vector<string> > cross_product;
-
-  // There's exactly one permutation of nothing
-  if (vectors.size() == 0) {
-    vector<string> empty;
-    cross_product.push_back(empty);
-    return cross_product;
+odometer::odometer(const vector<unsigned>& sizes) : sizes(sizes), digits(sizes.size(), 0) {
+  finished = false;
+  for (unsigned size : sizes) {
+    if (size == 0) {
+      finished = true;
+    }
   }
+}
 
-  vector<unsigned> indices(vectors.size(), 0);
-  while (true) {
-    vector<string> item;
-    item.reserve(vectors.size());
-    for (unsigned i = 0; i < vectors.size(); ++i) {
-      item.push_back(vectors[i][indices[i]]);
-    }
-    cross_product.push_back(item);
+bool odometer::done() const {
+  return finished;
+}
 
-    for (unsigned i = vectors.size(); i > 0;) {
-      --i;
-      indices[i]++;
-      if (indices[i] == vectors[i].size()) {
-        if (i != 0) {
-          indices[i] = 0;
-        }
-        else {
-          return cross_product;
-        }
-      }
-      else {
-        break;
-      }
+const vector<unsigned>& odometer::indices() const {
+  assert (!finished);
+  return digits;
+}
+
+// Advances the last index, carrying into earlier ones, so tuples come out
+// in lexicographic order: the last index varies fastest.
+void odometer::next() {
+  for (unsigned i = digits.size(); i > 0;) {
+    --i;
+    if (++digits[i] < sizes[i]) {
+      return;
     }
+    digits[i] = 0;
   }
+  finished = true;
 }
 
 unsigned int popCount(unsigned int i) {
@@ -77,42 +78,294 @@ void VerifySanity(const AMatrix& vector) {
   }
 }
 
-double log_sum_exp(vector<double> v) {
-  if (v.size() == 0) {
-    return -numeric_limits<double>::infinity();
+// Constants for the vectorized exp kernels below.
+// exp(x) = 2^n * exp(r) where n = round(x / ln 2) and |r| <= ln(2) / 2.
+// r is computed with a two-part (Cody-Waite) ln 2 so the reduction is exact,
+// and exp(r) is a degree 11 Taylor polynomial whose truncation error is
+// below 1e-14 relative on that interval. Inputs below kExpMin flush to zero
+// and inputs above kExpMax saturate, so 2^n always stays a normal double.
+// NaN is returned unchanged.
+static const double kExpMin = -708.0;
+static const double kExpMax = 709.0;
+static const double kLog2e = 1.4426950408889634074;
+static const double kLn2Hi = 6.93145751953125e-1;
+static const double kLn2Lo = 1.42860682030941723212e-6;
+static const double kExpCoeffs[] = {
+  1.0 / 39916800.0, 1.0 / 3628800.0, 1.0 / 362880.0, 1.0 / 40320.0,
+  1.0 / 5040.0, 1.0 / 720.0, 1.0 / 120.0, 1.0 / 24.0,
+  1.0 / 6.0, 1.0 / 2.0, 1.0, 1.0
+};
+static const unsigned kExpDegree = sizeof(kExpCoeffs) / sizeof(kExpCoeffs[0]);
+
+static inline double exp_kernel(double x) {
+  if (std::isnan(x)) {
+    return x;
   }
-  double m = v[0];
-  for (unsigned i = 1; i < v.size(); ++i) {
-    if (v[i] > m) {
-      m = v[i];
+  if (x < kExpMin) {
+    return 0.0;
+  }
+  x = min(x, kExpMax);
+#if defined(__AVX512F__) || defined(__AVX2__)
+  const double n = nearbyint(x * kLog2e);
+  const double r = x - n * kLn2Hi - n * kLn2Lo;
+  double p = kExpCoeffs[0];
+  for (unsigned i = 1; i < kExpDegree; ++i) {
+    p = p * r + kExpCoeffs[i];
+  }
+  const uint64_t bits = (uint64_t)((int64_t)n + 1023) << 52;
+  double scale;
+  memcpy(&scale, &bits, sizeof(scale));
+  return p * scale;
+#else
+  // Without the vector kernels the polynomial is slower than libm's exp
+  return exp(x);
+#endif
+}
+
+#if defined(__AVX512F__)
+static inline __m512d exp_kernel(__m512d x) {
+  const __m512d in = x;
+  const __m512d lo = _mm512_set1_pd(kExpMin);
+  const __mmask8 underflow = _mm512_cmp_pd_mask(x, lo, _CMP_LT_OQ);
+  const __mmask8 nan = _mm512_cmp_pd_mask(x, x, _CMP_UNORD_Q);
+  x = _mm512_min_pd(_mm512_max_pd(x, lo), _mm512_set1_pd(kExpMax));
+  const __m512d n = _mm512_roundscale_pd(_mm512_mul_pd(x, _mm512_set1_pd(kLog2e)),
+      _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m512d r = _mm512_fnmadd_pd(n, _mm512_set1_pd(kLn2Hi), x);
+  r = _mm512_fnmadd_pd(n, _mm512_set1_pd(kLn2Lo), r);
+  __m512d p = _mm512_set1_pd(kExpCoeffs[0]);
+  for (unsigned i = 1; i < kExpDegree; ++i) {
+    p = _mm512_fmadd_pd(p, r, _mm512_set1_pd(kExpCoeffs[i]));
+  }
+  p = _mm512_maskz_mov_pd(~underflow, _mm512_scalef_pd(p, n));
+  return _mm512_mask_mov_pd(p, nan, in);
+}
+#elif defined(__AVX2__)
+static inline __m256d madd(__m256d a, __m256d b, __m256d c) {
+#ifdef __FMA__
+  return _mm256_fmadd_pd(a, b, c);
+#else
+  return _mm256_add_pd(_mm256_mul_pd(a, b), c);
+#endif
+}
+
+static inline __m256d exp_kernel(__m256d x) {
+  const __m256d in = x;
+  const __m256d lo = _mm256_set1_pd(kExpMin);
+  const __m256d underflow = _mm256_cmp_pd(x, lo, _CMP_LT_OQ);
+  const __m256d nan = _mm256_cmp_pd(x, x, _CMP_UNORD_Q);
+  x = _mm256_min_pd(_mm256_max_pd(x, lo), _mm256_set1_pd(kExpMax));
+  const __m256d n = _mm256_round_pd(_mm256_mul_pd(x, _mm256_set1_pd(kLog2e)),
+      _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+  __m256d r = _mm256_sub_pd(x, _mm256_mul_pd(n, _mm256_set1_pd(kLn2Hi)));
+  r = _mm256_sub_pd(r, _mm256_mul_pd(n, _mm256_set1_pd(kLn2Lo)));
+  __m256d p = _mm256_set1_pd(kExpCoeffs[0]);
+  for (unsigned i = 1; i < kExpDegree; ++i) {
+    p = madd(p, r, _mm256_set1_pd(kExpCoeffs[i]));
+  }
+  // Adding 2^52 puts the integer n + 1023 in the low mantissa bits,
+  // and shifting it up by 52 moves it into the exponent field.
+  const __m256d biased = _mm256_add_pd(n, _mm256_set1_pd(4503599627370496.0 + 1023.0));
+  const __m256i bits = _mm256_slli_epi64(_mm256_castpd_si256(biased), 52);
+  p = _mm256_mul_pd(p, _mm256_castsi256_pd(bits));
+  p = _mm256_andnot_pd(underflow, p);
+  return _mm256_blendv_pd(p, in, nan);
+}
+
+static inline double hmax(__m256d v) {
+  __m128d m = _mm_max_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+  m = _mm_max_sd(m, _mm_unpackhi_pd(m, m));
+  return _mm_cvtsd_f64(m);
+}
+
+static inline double hsum(__m256d v) {
+  __m128d s = _mm_add_pd(_mm256_castpd256_pd128(v), _mm256_extractf128_pd(v, 1));
+  s = _mm_add_sd(s, _mm_unpackhi_pd(s, s));
+  return _mm_cvtsd_f64(s);
+}
+#endif
+
+double fast_exp(double x) {
+  return exp_kernel(x);
+}
+
+void fast_exp(const double* x, double* y, size_t n) {
+  size_t i = 0;
+#if defined(__AVX512F__)
+  for (; i + 8 <= n; i += 8) {
+    _mm512_storeu_pd(y + i, exp_kernel(_mm512_loadu_pd(x + i)));
+  }
+#elif defined(__AVX2__)
+  for (; i + 4 <= n; i += 4) {
+    _mm256_storeu_pd(y + i, exp_kernel(_mm256_loadu_pd(x + i)));
+  }
+#endif
+  for (; i < n; ++i) {
+    y[i] = exp_kernel(x[i]);
+  }
+}
+
+static double max_of(const double* v, size_t n) {
+  double m = -numeric_limits<double>::infinity();
+  size_t i = 0;
+#if defined(__AVX512F__)
+  if (n >= 8) {
+    __m512d vm = _mm512_loadu_pd(v);
+    for (i = 8; i + 8 <= n; i += 8) {
+      vm = _mm512_max_pd(vm, _mm512_loadu_pd(v + i));
     }
+    m = _mm512_reduce_max_pd(vm);
+  }
+#elif defined(__AVX2__)
+  if (n >= 4) {
+    __m256d vm = _mm256_loadu_pd(v);
+    for (i = 4; i + 4 <= n; i += 4) {
+      vm = _mm256_max_pd(vm, _mm256_loadu_pd(v + i));
+    }
+    m = hmax(vm);
+  }
+#endif
+  for (; i < n; ++i) {
+    m = max(m, v[i]);
   }
+  return m;
+}
 
+// Returns sum_i exp(v[i] - m)
+static double sum_exp_shifted(const double* v, size_t n, double m) {
   double sum = 0.0;
-  for (unsigned i = 0; i < v.size(); ++i) {
-    sum += exp(v[i] - m);
+  size_t i = 0;
+#if defined(__AVX512F__)
+  const __m512d vm = _mm512_set1_pd(m);
+  __m512d vs = _mm512_setzero_pd();
+  for (; i + 8 <= n; i += 8) {
+    vs = _mm512_add_pd(vs, exp_kernel(_mm512_sub_pd(_mm512_loadu_pd(v + i), vm)));
   }
-  return m + log(sum);
+  sum = _mm512_reduce_add_pd(vs);
+#elif defined(__AVX2__)
+  const __m256d vm = _mm256_set1_pd(m);
+  __m256d vs = _mm256_setzero_pd();
+  for (; i + 4 <= n; i += 4) {
+    vs = _mm256_add_pd(vs, exp_kernel(_mm256_sub_pd(_mm256_loadu_pd(v + i), vm)));
+  }
+  sum = hsum(vs);
+#endif
+  for (; i < n; ++i) {
+    sum += exp_kernel(v[i] - m);
+  }
+  return sum;
 }
 
-adouble log_sum_exp(vector<adouble> v) {
-  if (v.size() == 0) {
-    return -numeric_limits<double>::infinity();
+double log_sum_exp(const double* v, size_t n) {
+  const double m = max_of(v, n);
+  if (m == -numeric_limits<double>::infinity()) {
+    return m;
   }
-  adouble m = v[0];
-  for (unsigned i = 1; i < v.size(); ++i) {
+  return m + log(sum_exp_shifted(v, n, m));
+}
+
+// Keeps a running max and a sum scaled relative to it, rescaling the sum
+// whenever the max grows. Each lane does this independently and the lanes
+// are merged at the end, so the input is read exactly once.
+double log_sum_exp_online(const double* v, size_t n) {
+  const double lowest = -numeric_limits<double>::max();
+  double m = lowest;
+  double sum = 0.0;
+  size_t i = 0;
+#if defined(__AVX512F__)
+  if (n >= 8) {
+    __m512d vm = _mm512_set1_pd(lowest);
+    __m512d vs = _mm512_setzero_pd();
+    for (; i + 8 <= n; i += 8) {
+      const __m512d x = _mm512_loadu_pd(v + i);
+      const __m512d new_m = _mm512_max_pd(vm, x);
+      vs = _mm512_mul_pd(vs, exp_kernel(_mm512_sub_pd(vm, new_m)));
+      vs = _mm512_add_pd(vs, exp_kernel(_mm512_sub_pd(x, new_m)));
+      vm = new_m;
+    }
+    m = _mm512_reduce_max_pd(vm);
+    sum = _mm512_reduce_add_pd(_mm512_mul_pd(vs,
+        exp_kernel(_mm512_sub_pd(vm, _mm512_set1_pd(m)))));
+  }
+#elif defined(__AVX2__)
+  if (n >= 4) {
+    __m256d vm = _mm256_set1_pd(lowest);
+    __m256d vs = _mm256_setzero_pd();
+    for (; i + 4 <= n; i += 4) {
+      const __m256d x = _mm256_loadu_pd(v + i);
+      const __m256d new_m = _mm256_max_pd(vm, x);
+      vs = _mm256_mul_pd(vs, exp_kernel(_mm256_sub_pd(vm, new_m)));
+      vs = _mm256_add_pd(vs, exp_kernel(_mm256_sub_pd(x, new_m)));
+      vm = new_m;
+    }
+    m = hmax(vm);
+    sum = hsum(_mm256_mul_pd(vs, exp_kernel(_mm256_sub_pd(vm, _mm256_set1_pd(m)))));
+  }
+#endif
+  for (; i < n; ++i) {
     if (v[i] > m) {
+      sum = sum * exp_kernel(m - v[i]) + 1.0;
       m = v[i];
     }
+    else {
+      sum += exp_kernel(v[i] - m);
+    }
   }
-
-  adouble sum = 0.0;
-  for (unsigned i = 0; i < v.size(); ++i) {
-    sum += exp(v[i] - m);
+  if (sum == 0.0) {
+    return -numeric_limits<double>::infinity();
   }
   return m + log(sum);
 }
 
+double log_sum_exp(const vector<double>& v) {
+  return log_sum_exp(v.data(), v.size());
+}
+
+double percentile(vector<double> values, double p) {
+  assert (p >= 0.0 && p <= 100.0);
+  if (values.size() == 0) {
+    return 0.0;
+  }
+  size_t rank = (size_t)ceil(p / 100.0 * values.size());
+  rank = (rank == 0) ? 0 : rank - 1;
+  nth_element(values.begin(), values.begin() + rank, values.end());
+  return values[rank];
+}
+
+// Computes the value with the double kernels and records the result
+// as a single statement whose partial derivatives are the softmax
+// weights exp(v[i] - lse), rather than taping every exp, add and log.
+adouble log_sum_exp(const vector<adouble>& v) {
+  if (v.size() == 0) {
+    return -numeric_limits<double>::infinity();
+  }
+
+  static thread_local vector<double> weights;
+  weights.resize(v.size());
+  for (unsigned i = 0; i < v.size(); ++i) {
+    weights[i] = v[i].value();
+  }
+  const double m = max_of(weights.data(), weights.size());
+  if (m == -numeric_limits<double>::infinity()) {
+    return m;
+  }
+  for (unsigned i = 0; i < v.size(); ++i) {
+    weights[i] -= m;
+  }
+  fast_exp(weights.data(), weights.data(), weights.size());
+  double sum = 0.0;
+  for (double w : weights) {
+    sum += w;
+  }
+
+  adouble r;
+  r.set_value(m + log(sum));
+  r.add_derivative_dependence(v[0], weights[0] / sum);
+  for (unsigned i = 1; i < v.size(); ++i) {
+    r.append_derivative_dependence(v[i], weights[i] / sum);
+  }
+  return r;
+}
 
 ColumnVector convert(const AColumnVector& v) {
   ColumnVector r(v.size());
@@ -208,17 +461,43 @@ void WriteMatrix(const AMatrix& matrix, string filename) {
   f.close();
 }
 
+// Sets r to the given value and records it on the tape as a single
+// statement r = sum_k w(k) * x(k), skipping zero weights, so that a
+// whole dot product costs one statement instead of one per term.
+// If every weight is zero, r is still assigned a constant so that the tape
+// has a statement for it; otherwise the adjoint left at r's recycled
+// gradient index would leak into the next variable that gets it.
+template <class AVector, class Vector>
+static void record_dot(adouble& r, double value, const AVector& x, const Vector& w) {
+  r.set_value(value);
+  bool first = true;
+  for (int k = 0; k < w.size(); ++k) {
+    if (w(k) == 0.0) {
+      continue;
+    }
+    if (first) {
+      r.add_derivative_dependence(x(k), w(k));
+      first = false;
+    }
+    else {
+      r.append_derivative_dependence(x(k), w(k));
+    }
+  }
+  if (first) {
+    r = value;
+  }
+}
+
+// The mixed products below compute their values with Eigen's blocked
+// double GEMM and only touch the adouble operand to record derivatives.
 AMatrix amult(const AMatrix& a, const Matrix& b) {
   assert (a.cols() == b.rows());
+  const Matrix product = convert(a) * b;
   AMatrix r(a.rows(), b.cols());
 
-  for (unsigned int i = 0; i < a.rows(); ++i) {
-    for (unsigned int j = 0; j < b.cols(); ++j) {
-      adouble s = 0.0;
-      for (unsigned int k = 0; k < a.cols(); ++k) {
-        s += a(i, k) * b(k, j);
-      }
-      r(i, j) = s;
+  for (int j = 0; j < b.cols(); ++j) {
+    for (int i = 0; i < a.rows(); ++i) {
+      record_dot(r(i, j), product(i, j), a.row(i), b.col(j));
     }
   }
 
@@ -227,15 +506,12 @@ AMatrix amult(const AMatrix& a, const Matrix& b) {
 
 AMatrix amult(const Matrix& a, const AMatrix& b) {
   assert (a.cols() == b.rows());
+  const Matrix product = a * convert(b);
   AMatrix r(a.rows(), b.cols());
 
-  for (unsigned int i = 0; i < a.rows(); ++i) {
-    for (unsigned int j = 0; j < b.cols(); ++j) {
-      adouble s = 0.0;
-      for (unsigned int k = 0; k < a.cols(); ++k) {
-        s += a(i, k) * b(k, j);
-      }
-      r(i, j) = s;
+  for (int j = 0; j < b.cols(); ++j) {
+    for (int i = 0; i < a.rows(); ++i) {
+      record_dot(r(i, j), product(i, j), b.col(j), a.row(i));
     }
   }
 
@@ -12,7 +12,34 @@
 #include "adept.h"
 
 std::string to_lower_case(std::string s);
-std::vector<std::vector<std::string> > cross(std::vector<std::vector<std::string> > vectors);
+
+// Walks the cartesian product of ranges with the given sizes without
+// materializing it. indices() holds one index into each range; there is
+// exactly one (empty) tuple when there are no ranges, and none if any
+// range is empty. Typical use:
+//   for (odometer it(sizes); !it.done(); it.next()) { ... it.indices() ... }
+class odometer {
+public:
+  explicit odometer(const std::vector<unsigned>& sizes);
+  template <class T>
+  explicit odometer(const std::vector<std::vector<T> >& ranges) : odometer(sizes_of(ranges)) {}
+  bool done() const;
+  const std::vector<unsigned>& indices() const;
+  void next();
+
+private:
+  template <class T>
+  static std::vector<unsigned> sizes_of(const std::vector<std::vector<T> >& ranges) {
+    std::vector<unsigned> sizes;
+    for (const std::vector<T>& range : ranges) {
+      sizes.push_back(range.size());
+    }
+    return sizes;
+  }
+  std::vector<unsigned> sizes;
+  std::vector<unsigned> digits;
+  bool finished;
+};
 unsigned int popCount(unsigned int i);
 
 typedef Eigen::Matrix<adept::adouble, Eigen::Dynamic, 1> AColumnVector;
@@ -33,8 +60,23 @@ AMatrix cwiseTanh(const AMatrix& m);
 void VerifySanity(const Matrix& vector);
 void VerifySanity(const AMatrix& vector);
 
-double log_sum_exp(std::vector<double> v);
-adept::adouble log_sum_exp(std::vector<adept::adouble> v);
+// Vectorized exp (AVX-512 or AVX2 when compiled for it, scalar otherwise).
+// Relative error is below 1e-14 for inputs in [-708, 709]; smaller inputs
+// return 0, larger ones saturate at exp(709) and NaN is returned as is.
+// Without AVX2 or AVX-512 it calls exp, which is faster than the polynomial.
+double fast_exp(double x);
+void fast_exp(const double* x, double* y, size_t n);
+
+// log(sum_i exp(v[i])) over the n values starting at v.
+// log_sum_exp makes two passes (max, then sum of shifted exps) and is the
+// faster choice when the values are in cache. log_sum_exp_online reads the
+// values once, rescaling a running sum whenever the max changes.
+double log_sum_exp(const double* v, size_t n);
+double log_sum_exp_online(const double* v, size_t n);
+double log_sum_exp(const std::vector<double>& v);
+// The p-th percentile (0 <= p <= 100) of values, by nearest rank
+double percentile(std::vector<double> values, double p);
+adept::adouble log_sum_exp(const std::vector<adept::adouble>& v);
 
 AMatrix ReadMatrix(std::string filename);
 void WriteMatrix(const AMatrix& matrix, std::string filename);